@@ -27,10 +27,12 @@ namespace llvm {
   class Instruction;
   class Module;
   class DataLayout;
+  class TargetMachine;
 }
 
 namespace linker {
   class Linker;
+  struct PassContext;
 
   class LModule {
   public:
@@ -47,8 +49,16 @@ namespace linker {
     // Functions which are part of runtime
     std::set<const llvm::Function*> internalFunctions;
 
+  private:
+    // Analyses shared by all pass pipelines run over the module.
+    std::unique_ptr<PassContext> passes;
+
+    // Target used to expand inline asm, created on the first instrument().
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+
   public:
-    LModule() = default;
+    LModule();
+    ~LModule();
 
     /// Optimise and prepare module such that it can be executed
     //
@@ -74,6 +84,10 @@ namespace linker {
     /// Run passes that check if module is valid LLVM IR and if invariants
     /// expected by Linker hold.
     void checkModule();
+
+    /// Write the analyses of the final module that the Engine would
+    /// otherwise compute when loading it to the files requested.
+    void exportAnalyses();
   };
 } // End linker namespace
 
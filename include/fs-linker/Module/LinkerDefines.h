@@ -17,10 +17,13 @@ namespace linker {
 struct ModuleOptions {
   std::string EntryPoint;
   bool Optimize;
+  bool CheckDivZero;
+  bool CheckOvershift;
 
   ModuleOptions(const std::string &_EntryPoint,
-                bool _Optimize)
-      : EntryPoint(_EntryPoint), Optimize(_Optimize) {}
+                bool _Optimize, bool _CheckDivZero, bool _CheckOvershift)
+      : EntryPoint(_EntryPoint), Optimize(_Optimize),
+        CheckDivZero(_CheckDivZero), CheckOvershift(_CheckOvershift) {}
 };
 } // End linker namespace
 
@@ -17,6 +17,7 @@
 #else
 #include "llvm/IR/CallSite.h"
 #endif
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Module.h"
 
 #include <memory>
@@ -61,6 +62,13 @@ llvm::Function *getDirectCallTarget(
 /// terminates in a direct call).
 bool functionEscapes(const llvm::Function *f);
 
+/// Returns the entries of a llvm.global_ctors or llvm.global_dtors list
+/// ordered by ascending priority, keeping the list order among entries of
+/// the same priority. Constructors run in this order, destructors in the
+/// reverse one.
+std::vector<llvm::ConstantStruct *>
+getCtorListByPriority(const llvm::GlobalVariable *list);
+
 /// Loads the file libraryName and reads all possible modules out of it.
 ///
 /// Different file types are possible:
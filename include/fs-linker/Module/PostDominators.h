@@ -0,0 +1,81 @@
+//===-- PostDominators.h ----------------------------------------*- C++ -*-===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The FSPD file: immediate post-dominators and control dependences of the
+// functions of the final module, laid out so that the Engine can map the
+// file and use it in place instead of computing post-dominator trees when it
+// loads the module.
+//
+// All fields are little-endian 32 bit words, and every section is 4 byte
+// aligned. Offsets are in bytes from the start of the file. Blocks are
+// identified by their index in the function, in the order of the function's
+// block list.
+//
+//   Header
+//   FunctionEntry[numFunctions], sorted by name for binary search
+//   per function:
+//     uint32_t ipdom[numBlocks]          NoBlock if only the exit
+//                                        post-dominates the block
+//     uint32_t controlStart[numBlocks + 1]
+//     uint32_t controlBlocks[numControlEdges]
+//   the function names, not NUL terminated
+//
+// Block b is control dependent on the blocks
+// controlBlocks[controlStart[b]] .. controlBlocks[controlStart[b + 1] - 1],
+// which are the blocks whose branch decides whether b runs.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LINKER_POST_DOMINATORS_H
+#define LINKER_POST_DOMINATORS_H
+
+#include <cstdint>
+#include <string>
+
+namespace llvm {
+class Module;
+}
+
+namespace linker {
+namespace fspd {
+
+const char Magic[4] = {'F', 'S', 'P', 'D'};
+const uint32_t Version = 1;
+const uint32_t NoBlock = UINT32_MAX;
+
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t numFunctions;
+  uint32_t stringTableOffset;
+};
+
+struct FunctionEntry {
+  uint32_t nameOffset; // From the start of the string table
+  uint32_t nameSize;
+  uint32_t numBlocks;
+  uint32_t numControlEdges;
+  uint32_t ipdomOffset;
+  uint32_t controlStartOffset;
+  uint32_t controlBlocksOffset;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(Header) == 16, "FSPD header must be packed");
+static_assert(sizeof(FunctionEntry) == 32, "FSPD entry must be packed");
+
+} // namespace fspd
+
+/// Writes the post-dominators and control dependences of the functions
+/// defined in M to path as an FSPD file.
+void writePostDominators(llvm::Module &M, const std::string &path);
+
+} // namespace linker
+
+#endif /* LINKER_POST_DOMINATORS_H */
@@ -0,0 +1,239 @@
+//===-- Checks.cpp --------------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Inserts calls to klee_div_zero_check and klee_overshift_check before the
+// divisions and shifts that may fault. Operations whose divisor or shift
+// amount is proven to be in range, by known bits or by LazyValueInfo, are
+// left alone, since every check forks the engine.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LazyValueInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/KnownBits.h"
+
+using namespace llvm;
+
+namespace {
+
+// Marks instructions that have been checked or proven safe, since modules
+// linked in later are instrumented again.
+const char *const DivCheckedKind = "fs.check.div";
+const char *const ShiftCheckedKind = "fs.check.shift";
+
+bool isDivision(const BinaryOperator &I) {
+  switch (I.getOpcode()) {
+  case Instruction::SDiv:
+  case Instruction::UDiv:
+  case Instruction::SRem:
+  case Instruction::URem:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool isShift(const BinaryOperator &I) {
+  switch (I.getOpcode()) {
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Collects the operations of F matching isCandidate that are not marked with
+// kind yet, skipping vector operations that the scalarizer left behind.
+template <typename Predicate>
+std::vector<BinaryOperator *> collectCandidates(Function &F, unsigned kind,
+                                                Predicate isCandidate) {
+  std::vector<BinaryOperator *> candidates;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      auto *binOp = dyn_cast<BinaryOperator>(&I);
+      if (!binOp || !binOp->getType()->isIntegerTy() ||
+          !isCandidate(*binOp) || binOp->getMetadata(kind))
+        continue;
+      candidates.push_back(binOp);
+    }
+  return candidates;
+}
+} // namespace
+
+namespace linker {
+
+bool DivCheckPass::runOnModule(Module &M, FunctionAnalysisManager &FAM) {
+  LLVMContext &ctx = M.getContext();
+  unsigned kind = ctx.getMDKindID(DivCheckedKind);
+  MDNode *mark = MDNode::get(ctx, None);
+  FunctionCallee divZeroCheckFunction;
+  unsigned checked = 0, proven = 0;
+
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    std::vector<BinaryOperator *> divInstructions =
+        collectCandidates(F, kind, isDivision);
+    if (divInstructions.empty())
+      continue;
+
+    const DataLayout &DL = M.getDataLayout();
+    auto &LVI = FAM.getResult<LazyValueAnalysis>(F);
+    auto &AC = FAM.getResult<AssumptionAnalysis>(F);
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+
+    std::vector<BinaryOperator *> unsafe;
+    for (BinaryOperator *divInst : divInstructions) {
+      divInst->setMetadata(kind, mark);
+      Value *denominator = divInst->getOperand(1);
+      // Constant divisors other than zero are not interesting.
+      if (auto *c = dyn_cast<Constant>(denominator))
+        if (!c->isZeroValue())
+          continue;
+
+      if (isKnownNonZero(denominator, DL, 0, &AC, divInst, &DT) ||
+          !LVI.getConstantRange(denominator, divInst, /*UndefAllowed=*/false)
+               .contains(APInt::getZero(
+                   denominator->getType()->getIntegerBitWidth()))) {
+        ++proven;
+        continue;
+      }
+      unsafe.push_back(divInst);
+    }
+
+    if (unsafe.empty())
+      continue;
+    if (!divZeroCheckFunction)
+      divZeroCheckFunction = M.getOrInsertFunction(
+          "klee_div_zero_check", Type::getVoidTy(ctx), Type::getInt64Ty(ctx));
+    for (BinaryOperator *divInst : unsafe) {
+      llvm::IRBuilder<> Builder(divInst /* Inserts before divInst*/);
+      auto denominator =
+          Builder.CreateIntCast(divInst->getOperand(1), Type::getInt64Ty(ctx),
+                                false, /* sign doesn't matter */
+                                "int_cast_to_i64");
+      Builder.CreateCall(divZeroCheckFunction, denominator);
+      ++checked;
+    }
+    FAM.invalidate(F, PreservedAnalyses::none());
+  }
+
+  if (checked || proven)
+    linker_message("NOTE: inserted %u division by zero checks, %u divisions "
+                   "proven safe",
+                   checked, proven);
+  return checked != 0;
+}
+
+PreservedAnalyses DivCheckPass::run(Module &M, ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  if (!runOnModule(M, FAM))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
+bool OvershiftCheckPass::runOnModule(Module &M, FunctionAnalysisManager &FAM) {
+  LLVMContext &ctx = M.getContext();
+  unsigned kind = ctx.getMDKindID(ShiftCheckedKind);
+  MDNode *mark = MDNode::get(ctx, None);
+  FunctionCallee overshiftCheckFunction;
+  unsigned checked = 0, proven = 0;
+
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    std::vector<BinaryOperator *> shiftInstructions =
+        collectCandidates(F, kind, isShift);
+    if (shiftInstructions.empty())
+      continue;
+
+    const DataLayout &DL = M.getDataLayout();
+    auto &LVI = FAM.getResult<LazyValueAnalysis>(F);
+    auto &AC = FAM.getResult<AssumptionAnalysis>(F);
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+
+    std::vector<BinaryOperator *> unsafe;
+    for (BinaryOperator *shiftInst : shiftInstructions) {
+      shiftInst->setMetadata(kind, mark);
+      Value *shiftValue = shiftInst->getOperand(1);
+      unsigned bitWidth = shiftInst->getType()->getIntegerBitWidth();
+      // Constant shift amounts smaller than the width are not interesting.
+      if (auto *c = dyn_cast<ConstantInt>(shiftValue))
+        if (c->getValue().ult(bitWidth))
+          continue;
+
+      KnownBits known =
+          computeKnownBits(shiftValue, DL, 0, &AC, shiftInst, &DT);
+      if (known.getMaxValue().ult(bitWidth) ||
+          LVI.getConstantRange(shiftValue, shiftInst, /*UndefAllowed=*/false)
+              .getUnsignedMax()
+              .ult(bitWidth)) {
+        ++proven;
+        continue;
+      }
+      unsafe.push_back(shiftInst);
+    }
+
+    if (unsafe.empty())
+      continue;
+    if (!overshiftCheckFunction)
+      overshiftCheckFunction = M.getOrInsertFunction(
+          "klee_overshift_check", Type::getVoidTy(ctx), Type::getInt64Ty(ctx),
+          Type::getInt64Ty(ctx));
+    for (BinaryOperator *shiftInst : unsafe) {
+      llvm::IRBuilder<> Builder(shiftInst);
+      std::vector<llvm::Value *> args;
+      // Determine bit width of first operand
+      uint64_t bitWidth = shiftInst->getType()->getIntegerBitWidth();
+      args.push_back(ConstantInt::get(Type::getInt64Ty(ctx), bitWidth, false));
+      args.push_back(Builder.CreateIntCast(shiftInst->getOperand(1),
+                                           Type::getInt64Ty(ctx), false,
+                                           "int_cast_to_i64"));
+      Builder.CreateCall(overshiftCheckFunction, args);
+      ++checked;
+    }
+    FAM.invalidate(F, PreservedAnalyses::none());
+  }
+
+  if (checked || proven)
+    linker_message("NOTE: inserted %u overshift checks, %u shifts proven safe",
+                   checked, proven);
+  return checked != 0;
+}
+
+PreservedAnalyses OvershiftCheckPass::run(Module &M,
+                                          ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  if (!runOnModule(M, FAM))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
+void stripCheckMarkers(Module &M) {
+  LLVMContext &ctx = M.getContext();
+  unsigned divKind = ctx.getMDKindID(DivCheckedKind);
+  unsigned shiftKind = ctx.getMDKindID(ShiftCheckedKind);
+  for (Function &F : M)
+    for (Instruction &I : instructions(F)) {
+      I.setMetadata(divKind, nullptr);
+      I.setMetadata(shiftKind, nullptr);
+    }
+}
+} // namespace linker
@@ -0,0 +1,136 @@
+//===-- ComplexityReport.cpp ----------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Writes a CSV file with one line per defined function of the final module,
+// listing what makes the function expensive for the Engine, to help decide
+// which functions to model, stub or alias:
+//
+//   instructions        size of the function
+//   branches            conditional branches, each a possible fork
+//   switches, cases     switches and their cases before --switch-type
+//                       lowered them, and those left afterwards
+//   loops, loop_depth   number of loops and the deepest nesting
+//   indirect_calls      calls through function pointers
+//   inline_asm          inline asm calls left after RaiseAsm
+//   fp_ops              floating point arithmetic, comparisons and casts
+//   engine_calls        calls of the Engine API (klee_*, gs_*, ...)
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace {
+
+bool isFloatingPointOp(const Instruction &I) {
+  switch (I.getOpcode()) {
+  case Instruction::FAdd:
+  case Instruction::FSub:
+  case Instruction::FMul:
+  case Instruction::FDiv:
+  case Instruction::FRem:
+  case Instruction::FNeg:
+  case Instruction::FCmp:
+  case Instruction::FPToUI:
+  case Instruction::FPToSI:
+  case Instruction::UIToFP:
+  case Instruction::SIToFP:
+  case Instruction::FPTrunc:
+  case Instruction::FPExt:
+    return true;
+  default:
+    return false;
+  }
+}
+
+std::pair<unsigned, unsigned> countSwitches(Function &F) {
+  std::pair<unsigned, unsigned> switches(0, 0);
+  for (BasicBlock &BB : F)
+    if (auto *SI = dyn_cast<SwitchInst>(BB.getTerminator())) {
+      ++switches.first;
+      switches.second += SI->getNumCases();
+    }
+  return switches;
+}
+
+} // namespace
+
+namespace linker {
+
+void ComplexityReport::recordSwitches(Module &M) {
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      switchesBefore[F.getName()] = countSwitches(F);
+}
+
+void ComplexityReport::write(Module &M, FunctionAnalysisManager &FAM,
+                             StringRef reportFile) {
+  std::error_code EC;
+  raw_fd_ostream report(reportFile, EC, sys::fs::OF_Text);
+  if (EC)
+    linker_error("Unable to open '%s': %s", reportFile.str().c_str(),
+                 EC.message().c_str());
+
+  report << "function,instructions,branches,switches_before,cases_before,"
+            "switches_after,cases_after,loops,loop_depth,indirect_calls,"
+            "inline_asm,fp_ops,engine_calls\n";
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+
+    unsigned numInstructions = 0, branches = 0, indirectCalls = 0,
+             inlineAsm = 0, fpOps = 0, engineCalls = 0;
+    for (Instruction &I : instructions(F)) {
+      ++numInstructions;
+      if (auto *br = dyn_cast<BranchInst>(&I)) {
+        branches += br->isConditional();
+        continue;
+      }
+      if (isFloatingPointOp(I)) {
+        ++fpOps;
+        continue;
+      }
+      auto *call = dyn_cast<CallBase>(&I);
+      if (!call)
+        continue;
+      if (call->isInlineAsm())
+        ++inlineAsm;
+      // Calls through a bitcast of a function are still direct calls.
+      else if (const auto *callee = dyn_cast<Function>(
+                   call->getCalledOperand()->stripPointerCasts()))
+        engineCalls += isEngineFunction(*callee);
+      else
+        ++indirectCalls;
+    }
+
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    unsigned loops = 0, loopDepth = 0;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      ++loops;
+      loopDepth = std::max(loopDepth, L->getLoopDepth());
+    }
+
+    std::pair<unsigned, unsigned> before = switchesBefore.lookup(F.getName());
+    std::pair<unsigned, unsigned> after = countSwitches(F);
+    report << F.getName() << ',' << numInstructions << ',' << branches << ','
+           << before.first << ',' << before.second << ',' << after.first
+           << ',' << after.second << ',' << loops << ',' << loopDepth << ','
+           << indirectCalls << ',' << inlineAsm << ',' << fpOps << ','
+           << engineCalls << '\n';
+  }
+}
+} // namespace linker
@@ -0,0 +1,408 @@
+//===-- ConcreteOnly.cpp --------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Finds the functions that never touch symbolic data, so that the Engine can
+// run them on a concrete fast path or natively.
+//
+// Symbolic data is tracked by an interprocedural, flow-insensitive taint
+// analysis. It is seeded by the calls that create symbolic data:
+// klee_make_symbolic and friends, the gs_* API, and the model entry points
+// that fill buffers with input, such as read. Memory is tracked per
+// allocation site (global, alloca or allocation call); everything reached
+// through a pointer of unknown origin is one more location, which stands for
+// all the sites whose address escapes. A site passed to a call escapes even
+// if the argument is nocapture, since the callee reads it through a pointer
+// of unknown origin.
+//
+// A function is concrete-only if none of its values may be tainted, it does
+// not call into the Engine, and all the functions it may call are
+// concrete-only as well. Such functions get the "fs-concrete-only" attribute.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "concrete-only"
+
+ALWAYS_ENABLED_STATISTIC(NumConcreteOnly,
+                         "Number of functions marked concrete-only");
+
+namespace {
+
+// Calls returning symbolic data or filling the memory they are passed with
+// it. Functions starting with gs_ are matched by prefix.
+const char *const symbolicSources[] = {
+    // Engine API
+    "klee_make_symbolic", "make_symbolic", "klee_int", "klee_range",
+    // Model entry points reading input
+    "read", "pread", "pread64", "readv", "fread", "fgets", "fgetc", "getc",
+    "getchar", "recv", "recvfrom", "getline",
+};
+
+bool isSymbolicSource(const Function *F) {
+  StringRef name = F->getName();
+  if (name.startswith("gs_"))
+    return true;
+  for (const char *source : symbolicSources)
+    if (name == source)
+      return true;
+  return false;
+}
+
+// Calls into the Engine, which cannot happen on a concrete fast path.
+bool isEngineCall(const Function *F) {
+  StringRef name = F->getName();
+  return F->isDeclaration() &&
+         (name.startswith("klee_") || name.startswith("gs_"));
+}
+
+// Whether ptr, or a pointer derived from it, is passed to a call. The callee
+// reaches that memory through a pointer of unknown origin, so the memory
+// escapes even if the argument is nocapture.
+bool isPassedToCall(const Value *ptr) {
+  SmallVector<const Value *, 8> worklist{ptr};
+  SmallPtrSet<const Value *, 8> visited;
+  while (!worklist.empty()) {
+    const Value *V = worklist.pop_back_val();
+    if (!visited.insert(V).second)
+      continue;
+    for (const User *U : V->users()) {
+      if (const auto *call = dyn_cast<CallBase>(U)) {
+        // Memory intrinsics are handled on the location itself.
+        if (!isa<MemIntrinsic>(call) && !call->isLifetimeStartOrEnd())
+          return true;
+        continue;
+      }
+      if (isa<GEPOperator>(U) || isa<BitCastOperator>(U) ||
+          isa<AddrSpaceCastOperator>(U) || isa<PHINode>(U) ||
+          isa<SelectInst>(U))
+        worklist.push_back(U);
+    }
+  }
+  return false;
+}
+
+class TaintAnalysis {
+  Module &M;
+
+  DenseSet<const Value *> taintedValues;
+  // Allocation sites whose memory may hold symbolic data.
+  DenseSet<const Value *> taintedLocations;
+  // Whether memory reached through pointers of unknown origin may.
+  bool unknownTainted = false;
+  DenseSet<const Value *> escaped;
+  DenseSet<const Function *> taintedReturns;
+  std::vector<Function *> addressTaken;
+  bool changed = false;
+
+  // Returns the allocation site ptr points into, or null if unknown.
+  const Value *getLocation(const Value *ptr) const {
+    const Value *object = getUnderlyingObject(ptr);
+    if (isa<GlobalVariable>(object) || isa<AllocaInst>(object) ||
+        isNoAliasCall(object))
+      return object;
+    return nullptr;
+  }
+
+  bool isTainted(const Value *V) const { return taintedValues.count(V); }
+
+  bool isLocationTainted(const Value *location) const {
+    if (!location)
+      return unknownTainted;
+    return taintedLocations.count(location) ||
+           (unknownTainted && escaped.count(location));
+  }
+
+  void taint(const Value *V) {
+    if (taintedValues.insert(V).second)
+      changed = true;
+  }
+
+  void taintLocation(const Value *location) {
+    if (location && taintedLocations.insert(location).second)
+      changed = true;
+    if ((!location || escaped.count(location)) && !unknownTainted) {
+      unknownTainted = true;
+      changed = true;
+    }
+  }
+
+  void taintMemoryOf(const Value *ptr) {
+    if (ptr->getType()->isPointerTy())
+      taintLocation(getLocation(ptr));
+  }
+
+  void visitCall(CallBase &call);
+  void visitCallee(CallBase &call, Function &callee);
+  void visit(Instruction &I);
+
+public:
+  explicit TaintAnalysis(Module &M);
+
+  void run();
+
+  bool touchesSymbolicData(const Function &F) const;
+};
+
+TaintAnalysis::TaintAnalysis(Module &M) : M(M) {
+  for (GlobalVariable &GV : M.globals())
+    if (!GV.hasLocalLinkage() || PointerMayBeCaptured(&GV, true, true) ||
+        isPassedToCall(&GV))
+      escaped.insert(&GV);
+  for (Function &F : M) {
+    if (F.hasAddressTaken())
+      addressTaken.push_back(&F);
+    for (Instruction &I : instructions(F))
+      if ((isa<AllocaInst>(I) || isNoAliasCall(&I)) &&
+          (PointerMayBeCaptured(&I, true, true) || isPassedToCall(&I)))
+        escaped.insert(&I);
+  }
+}
+
+void TaintAnalysis::visitCallee(CallBase &call, Function &callee) {
+  if (isSymbolicSource(&callee)) {
+    taint(&call);
+    for (Value *arg : call.args())
+      taintMemoryOf(arg);
+    return;
+  }
+
+  if (callee.isDeclaration()) {
+    // Assume the external function reads and writes what it is passed.
+    bool symbolic = false;
+    for (Value *arg : call.args())
+      symbolic |= isTainted(arg) || (arg->getType()->isPointerTy() &&
+                                     isLocationTainted(getLocation(arg)));
+    if (symbolic) {
+      taint(&call);
+      for (Value *arg : call.args())
+        taintMemoryOf(arg);
+    }
+    return;
+  }
+
+  for (unsigned i = 0, e = call.arg_size(); i != e; ++i) {
+    if (!isTainted(call.getArgOperand(i)))
+      continue;
+    if (i < callee.arg_size())
+      taint(callee.getArg(i));
+    else // Variadic arguments are read through the va_list.
+      taintLocation(nullptr);
+  }
+  if (taintedReturns.count(&callee))
+    taint(&call);
+}
+
+void TaintAnalysis::visitCall(CallBase &call) {
+  if (auto *transfer = dyn_cast<MemTransferInst>(&call)) {
+    if (isTainted(transfer->getRawSource()) ||
+        isTainted(transfer->getLength()) ||
+        isLocationTainted(getLocation(transfer->getRawSource())))
+      taintMemoryOf(transfer->getRawDest());
+    return;
+  }
+  if (auto *set = dyn_cast<MemSetInst>(&call)) {
+    if (isTainted(set->getValue()) || isTainted(set->getLength()))
+      taintMemoryOf(set->getRawDest());
+    return;
+  }
+
+  if (Function *callee = call.getCalledFunction()) {
+    if (callee->isIntrinsic()) {
+      for (Value *arg : call.args())
+        if (isTainted(arg))
+          taint(&call);
+      return;
+    }
+    visitCallee(call, *callee);
+    return;
+  }
+
+  if (call.isInlineAsm()) {
+    for (Value *arg : call.args())
+      if (isTainted(arg))
+        taint(&call);
+    return;
+  }
+
+  // An indirect call may reach any function whose address is taken.
+  if (isTainted(call.getCalledOperand()))
+    taint(&call);
+  for (Function *callee : addressTaken)
+    if (callee->arg_size() == call.arg_size() ||
+        (callee->isVarArg() && callee->arg_size() <= call.arg_size()))
+      visitCallee(call, *callee);
+}
+
+void TaintAnalysis::visit(Instruction &I) {
+  if (auto *load = dyn_cast<LoadInst>(&I)) {
+    Value *ptr = load->getPointerOperand();
+    if (isTainted(ptr) || isLocationTainted(getLocation(ptr)))
+      taint(load);
+    return;
+  }
+  if (auto *store = dyn_cast<StoreInst>(&I)) {
+    if (isTainted(store->getValueOperand()) ||
+        isTainted(store->getPointerOperand()))
+      taintMemoryOf(store->getPointerOperand());
+    return;
+  }
+  if (isa<AtomicRMWInst>(I) || isa<AtomicCmpXchgInst>(I)) {
+    Value *ptr = I.getOperand(0);
+    bool symbolic = isLocationTainted(getLocation(ptr));
+    for (Value *operand : I.operands())
+      symbolic |= isTainted(operand);
+    if (symbolic) {
+      taint(&I);
+      taintMemoryOf(ptr);
+    }
+    return;
+  }
+  if (auto *call = dyn_cast<CallBase>(&I)) {
+    visitCall(*call);
+    return;
+  }
+  if (auto *ret = dyn_cast<ReturnInst>(&I)) {
+    Value *value = ret->getReturnValue();
+    if (value && isTainted(value) &&
+        taintedReturns.insert(ret->getFunction()).second)
+      changed = true;
+    return;
+  }
+  if (isa<VAArgInst>(I)) {
+    if (unknownTainted)
+      taint(&I);
+    return;
+  }
+
+  for (Value *operand : I.operands())
+    if (isTainted(operand)) {
+      taint(&I);
+      return;
+    }
+}
+
+void TaintAnalysis::run() {
+  do {
+    changed = false;
+    for (Function &F : M)
+      for (Instruction &I : instructions(F))
+        visit(I);
+  } while (changed);
+}
+
+bool TaintAnalysis::touchesSymbolicData(const Function &F) const {
+  for (const Argument &arg : F.args())
+    if (isTainted(&arg))
+      return true;
+  for (const Instruction &I : instructions(F)) {
+    if (isTainted(&I))
+      return true;
+    if (const auto *call = dyn_cast<CallBase>(&I))
+      if (const Function *callee = call->getCalledFunction())
+        if (isSymbolicSource(callee) || isEngineCall(callee))
+          return true;
+  }
+  return false;
+}
+
+} // namespace
+
+namespace linker {
+
+bool ConcreteOnlyPass::runOnModule(Module &M) {
+  TaintAnalysis taint(M);
+  taint.run();
+
+  std::vector<Function *> addressTaken;
+  DenseSet<const Function *> concrete;
+  for (Function &F : M) {
+    if (F.hasAddressTaken())
+      addressTaken.push_back(&F);
+    if (!F.isDeclaration() && !taint.touchesSymbolicData(F))
+      concrete.insert(&F);
+  }
+
+  // Drop the functions that may call a function that is not concrete-only.
+  auto isConcreteCall = [&](const CallBase &call) {
+    if (const Function *callee = call.getCalledFunction())
+      return callee->isDeclaration() || concrete.count(callee) != 0;
+    if (call.isInlineAsm())
+      return true;
+    return std::all_of(addressTaken.begin(), addressTaken.end(),
+                       [&](const Function *callee) {
+                         return callee->isDeclaration() ||
+                                concrete.count(callee) != 0;
+                       });
+  };
+  bool changed;
+  do {
+    changed = false;
+    for (Function &F : M) {
+      if (!concrete.count(&F))
+        continue;
+      for (Instruction &I : instructions(F)) {
+        auto *call = dyn_cast<CallBase>(&I);
+        if (call && !isConcreteCall(*call)) {
+          concrete.erase(&F);
+          changed = true;
+          break;
+        }
+      }
+    }
+  } while (changed);
+
+  std::unique_ptr<raw_fd_ostream> list;
+  if (!listFile.empty()) {
+    std::error_code EC;
+    list = std::make_unique<raw_fd_ostream>(listFile, EC, sys::fs::OF_Text);
+    if (EC)
+      linker_error("Unable to open '%s': %s", listFile.c_str(),
+                   EC.message().c_str());
+  }
+
+  for (Function &F : M) {
+    if (!concrete.count(&F))
+      continue;
+    F.addFnAttr("fs-concrete-only");
+    ++NumConcreteOnly;
+    if (list)
+      *list << F.getName() << '\n';
+  }
+  return !concrete.empty();
+}
+
+PreservedAnalyses ConcreteOnlyPass::run(Module &M, ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+} // namespace linker
@@ -0,0 +1,106 @@
+//===-- ConstifyGlobals.cpp -----------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Marks the internal globals that are never written as constant. The Engine
+// keeps constant globals in read-only memory objects, and constant merging
+// can fold them with identical ones afterwards.
+//
+// Unlike globalopt, nothing else about the global or its users is changed.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "constify-globals"
+
+ALWAYS_ENABLED_STATISTIC(NumConstified, "Number of globals marked constant");
+
+namespace {
+
+// Returns true if the memory of GV may be written through one of its uses.
+// Any use that lets the address escape counts as a write.
+bool mayBeWritten(const GlobalVariable &GV) {
+  SmallVector<const Use *, 16> worklist;
+  SmallPtrSet<const Value *, 16> visited;
+  for (const Use &U : GV.uses())
+    worklist.push_back(&U);
+
+  while (!worklist.empty()) {
+    const Use &U = *worklist.pop_back_val();
+    const User *user = U.getUser();
+
+    if (isa<LoadInst>(user) || isa<ICmpInst>(user))
+      continue;
+    if (isa<StoreInst>(user))
+      return true;
+    if (const auto *transfer = dyn_cast<MemTransferInst>(user)) {
+      if (U.getOperandNo() == 1 && !transfer->isVolatile())
+        continue;
+      return true;
+    }
+    if (const auto *call = dyn_cast<CallBase>(user)) {
+      if (call->isArgOperand(&U)) {
+        unsigned arg = call->getArgOperandNo(&U);
+        if (call->onlyReadsMemory(arg) && call->doesNotCapture(arg))
+          continue;
+      }
+      return true;
+    }
+    // Derived pointers into the same global: follow their uses.
+    if (isa<GEPOperator>(user) || isa<BitCastOperator>(user) ||
+        isa<AddrSpaceCastOperator>(user) || isa<PHINode>(user) ||
+        isa<SelectInst>(user)) {
+      if (visited.insert(user).second)
+        for (const Use &UU : user->uses())
+          worklist.push_back(&UU);
+      continue;
+    }
+    // Stored into another initializer, converted to an integer, returned...
+    return true;
+  }
+  return false;
+}
+
+} // namespace
+
+namespace linker {
+
+bool ConstifyGlobalsPass::runOnModule(Module &M) {
+  bool changed = false;
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.isConstant() || !GV.hasLocalLinkage() ||
+        !GV.hasDefinitiveInitializer() || GV.isExternallyInitialized() ||
+        GV.isThreadLocal() || GV.getName().startswith("llvm."))
+      continue;
+    if (mayBeWritten(GV))
+      continue;
+    GV.setConstant(true);
+    ++NumConstified;
+    changed = true;
+  }
+  return changed;
+}
+
+PreservedAnalyses ConstifyGlobalsPass::run(Module &M,
+                                           ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+} // namespace linker
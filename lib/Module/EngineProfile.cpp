@@ -0,0 +1,122 @@
+//===-- EngineProfile.cpp -------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Reads a per-function profile of earlier Engine runs, such as coverage hit
+// counts or time spent, and turns it into function attributes that the
+// inliner and OptNonePass act on. The profile has one "name count" line per
+// function; blank lines and lines starting with '#' are ignored.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace linker;
+
+namespace {
+
+StringMap<uint64_t> readProfile(const std::string &path) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer)
+    linker_error("engine-profile: unable to read '%s': %s", path.c_str(),
+                 buffer.getError().message().c_str());
+
+  StringMap<uint64_t> counts;
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n');
+  for (unsigned i = 0; i < lines.size(); ++i) {
+    StringRef line = lines[i].trim();
+    if (line.empty() || line.startswith("#"))
+      continue;
+    StringRef name, count;
+    std::tie(name, count) = getToken(line);
+    uint64_t value;
+    if (count.trim().getAsInteger(10, value))
+      linker_error("engine-profile: %s:%u: expected 'name count'",
+                   path.c_str(), i + 1);
+    counts[name] += value;
+  }
+  return counts;
+}
+} // namespace
+
+namespace linker {
+
+bool EngineProfilePass::runOnModule(Module &M) {
+  StringMap<uint64_t> counts = readProfile(profilePath);
+
+  // The hottest functions that together account for hotPercent of the
+  // total count are hot.
+  std::vector<std::pair<uint64_t, Function *>> executed;
+  uint64_t total = 0;
+  for (Function &F : M) {
+    auto it = counts.find(F.getName());
+    if (F.isDeclaration() || it == counts.end() || !it->second)
+      continue;
+    executed.emplace_back(it->second, &F);
+    total += it->second;
+  }
+  std::stable_sort(executed.begin(), executed.end(),
+                   [](const std::pair<uint64_t, Function *> &a,
+                      const std::pair<uint64_t, Function *> &b) {
+                     return a.first > b.first;
+                   });
+
+  bool changed = false;
+  unsigned hot = 0, cold = 0;
+  uint64_t covered = 0;
+  for (auto &entry : executed) {
+    if (covered * 100 >= total * hotPercent)
+      break;
+    covered += entry.first;
+    Function *F = entry.second;
+    if (F->hasFnAttribute(Attribute::OptimizeNone))
+      continue;
+    F->addFnAttr(Attribute::Hot);
+    if (!F->hasFnAttribute(Attribute::NoInline))
+      F->addFnAttr(Attribute::InlineHint);
+    ++hot;
+    changed = true;
+  }
+
+  // Functions that are listed but were never executed are kept as they are.
+  for (Function &F : M) {
+    auto it = counts.find(F.getName());
+    if (F.isDeclaration() || it == counts.end() || it->second ||
+        F.hasFnAttribute(Attribute::AlwaysInline) ||
+        F.hasFnAttribute(Attribute::OptimizeNone))
+      continue;
+    F.removeFnAttr(Attribute::InlineHint);
+    F.addFnAttr(Attribute::Cold);
+    F.addFnAttr(Attribute::NoInline);
+    F.addFnAttr(Attribute::OptimizeNone);
+    ++cold;
+    changed = true;
+  }
+
+  linker_message("NOTE: engine profile marked %u functions hot and %u cold",
+                 hot, cold);
+  return changed;
+}
+
+PreservedAnalyses EngineProfilePass::run(Module &M, ModuleAnalysisManager &) {
+  // Only function attributes change, which no analysis depends on.
+  runOnModule(M);
+  return PreservedAnalyses::all();
+}
+} // namespace linker
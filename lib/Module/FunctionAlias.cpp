@@ -131,6 +131,10 @@ bool FunctionAliasPass::runOnModule(Module &M) {
   return modified;
 }
 
+PreservedAnalyses FunctionAliasPass::run(Module &M, ModuleAnalysisManager &) {
+  return runOnModule(M) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
 const FunctionType *FunctionAliasPass::getFunctionType(const GlobalValue *gv) {
   const Type *type = gv->getType();
   while (type->isPointerTy()) {
@@ -215,6 +219,4 @@ bool FunctionAliasPass::isFunctionOrGlobalFunctionAlias(const GlobalValue *gv) {
   return false;
 }
 
-char FunctionAliasPass::ID = 0;
-
 } // namespace linker
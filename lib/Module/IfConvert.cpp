@@ -0,0 +1,193 @@
+//===-- IfConvert.cpp -----------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Flattens small diamonds and triangles of the control flow graph into
+// selects. The Engine forks a state at every branch on a symbolic condition,
+// while a select on it only builds an if-then-else term, so each flattened
+// branch removes a fork.
+//
+// A diamond is a block BB branching to T and F, which both go on to M. In a
+// triangle, BB branches to T and M, and T goes on to M. T and F have BB as
+// their only predecessor and M as their only successor. Their instructions
+// are moved into BB if they are all safe to speculate and there are no more
+// of them than the threshold, counting both sides, and the phis of M choose
+// between their values with a select on the condition.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "if-convert"
+
+ALWAYS_ENABLED_STATISTIC(NumDiamonds,
+                         "Number of diamonds flattened into selects");
+ALWAYS_ENABLED_STATISTIC(NumTriangles,
+                         "Number of triangles flattened into selects");
+ALWAYS_ENABLED_STATISTIC(NumSelects,
+                         "Number of selects created by if-conversion");
+
+namespace {
+
+// Returns the successor of Side if Side is a block that can be moved into its
+// only predecessor BB, or null.
+BasicBlock *getSideSuccessor(BasicBlock *Side, BasicBlock *BB) {
+  if (Side == BB || Side->getSinglePredecessor() != BB ||
+      isa<PHINode>(Side->front()))
+    return nullptr;
+  auto *br = dyn_cast<BranchInst>(Side->getTerminator());
+  if (!br || br->isConditional())
+    return nullptr;
+  return br->getSuccessor(0);
+}
+
+// Adds the number of instructions of Side to cost. Returns false if any of
+// them cannot be speculated.
+bool addSpeculationCost(BasicBlock *Side, unsigned &cost) {
+  for (Instruction &I : *Side) {
+    if (I.isTerminator() || isa<DbgInfoIntrinsic>(I))
+      continue;
+    if (!isSafeToSpeculativelyExecute(&I))
+      return false;
+    ++cost;
+  }
+  return true;
+}
+
+// Moves the instructions of Side apart from its terminator before the
+// terminator of BB.
+void hoist(BasicBlock *Side, BasicBlock *BB) {
+  BB->getInstList().splice(BB->getTerminator()->getIterator(),
+                           Side->getInstList(), Side->begin(),
+                           Side->getTerminator()->getIterator());
+}
+
+// Flattens the diamond or triangle the conditional branch of BB starts, if
+// there is one, and adds the blocks it erased to erased. Returns true if it
+// did.
+bool convert(BasicBlock *BB, unsigned threshold,
+             SmallPtrSetImpl<BasicBlock *> &erased) {
+  auto *br = dyn_cast<BranchInst>(BB->getTerminator());
+  if (!br || br->isUnconditional())
+    return false;
+  BasicBlock *True = br->getSuccessor(0), *False = br->getSuccessor(1);
+  if (True == False)
+    return false;
+
+  // The side that is BB itself in a triangle has nothing to move.
+  BasicBlock *trueSucc = getSideSuccessor(True, BB);
+  BasicBlock *falseSucc = getSideSuccessor(False, BB);
+  BasicBlock *Merge;
+  if (trueSucc && trueSucc == falseSucc) {
+    Merge = trueSucc;
+  } else if (trueSucc && trueSucc == False) {
+    Merge = False;
+    False = BB;
+  } else if (falseSucc && falseSucc == True) {
+    Merge = True;
+    True = BB;
+  } else {
+    return false;
+  }
+  if (Merge == BB)
+    return false;
+
+  unsigned cost = 0;
+  if ((True != BB && !addSpeculationCost(True, cost)) ||
+      (False != BB && !addSpeculationCost(False, cost)) || cost > threshold)
+    return false;
+
+  if (True != BB)
+    hoist(True, BB);
+  if (False != BB)
+    hoist(False, BB);
+
+  Value *cond = br->getCondition();
+  IRBuilder<> Builder(br);
+  for (PHINode &phi : Merge->phis()) {
+    Value *trueValue = phi.getIncomingValueForBlock(True);
+    Value *falseValue = phi.getIncomingValueForBlock(False);
+    Value *value = trueValue;
+    if (trueValue != falseValue) {
+      value = Builder.CreateSelect(cond, trueValue, falseValue,
+                                   phi.getName() + ".sel");
+      ++NumSelects;
+    }
+    if (True != BB)
+      phi.removeIncomingValue(True, false);
+    if (False != BB)
+      phi.removeIncomingValue(False, false);
+    int index = phi.getBasicBlockIndex(BB);
+    if (index < 0)
+      phi.addIncoming(value, BB);
+    else
+      phi.setIncomingValue(index, value);
+  }
+
+  Builder.CreateBr(Merge);
+  br->eraseFromParent();
+  for (BasicBlock *Side : {True, False})
+    if (Side != BB) {
+      Side->dropAllReferences();
+      Side->eraseFromParent();
+      erased.insert(Side);
+    }
+  // Without other predecessors, the merge block just continues BB.
+  if (MergeBlockIntoPredecessor(Merge))
+    erased.insert(Merge);
+
+  if (True == BB || False == BB)
+    ++NumTriangles;
+  else
+    ++NumDiamonds;
+  return true;
+}
+
+} // namespace
+
+namespace linker {
+
+bool IfConvertPass::runOnFunction(Function &F) {
+  if (F.hasOptNone())
+    return false;
+
+  // Flattening an inner diamond may turn the branch around it into a
+  // diamond of plain blocks. Visiting the blocks in post order does the
+  // inner ones first, the loop catches the rest.
+  bool changed = false, local;
+  do {
+    local = false;
+    std::vector<BasicBlock *> blocks(po_begin(&F.getEntryBlock()),
+                                     po_end(&F.getEntryBlock()));
+    SmallPtrSet<BasicBlock *, 16> erased;
+    for (BasicBlock *BB : blocks) {
+      if (!erased.count(BB))
+        local |= convert(BB, threshold, erased);
+    }
+    changed |= local;
+  } while (local);
+  return changed;
+}
+
+PreservedAnalyses IfConvertPass::run(Function &F,
+                                     FunctionAnalysisManager &) {
+  if (!runOnFunction(F))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+} // namespace linker
@@ -15,59 +15,63 @@ using namespace llvm;
 
 namespace {
 
-void printOperandWarning(const char *expected, const Instruction *i, Type *ty,
+void printOperandWarning(std::vector<std::string> &messages,
+                         const char *expected, const Instruction *i, Type *ty,
                          unsigned opNum) {
   std::string msg;
   llvm::raw_string_ostream ss(msg);
   ss << "Found unexpected type (" << *ty << ") at operand " << opNum
      << ". Expected " << expected << " in " << *i;
   i->print(ss);
-  ss.flush();
-  linker::linker_message("%s", msg.c_str());
+  messages.push_back(std::move(ss.str()));
 }
 
-bool checkOperandTypeIsScalarInt(const Instruction *i, unsigned opNum) {
+bool checkOperandTypeIsScalarInt(std::vector<std::string> &messages,
+                                 const Instruction *i, unsigned opNum) {
   assert(opNum < i->getNumOperands());
   llvm::Type *ty = i->getOperand(opNum)->getType();
   if (!(ty->isIntegerTy())) {
-    printOperandWarning("scalar integer", i, ty, opNum);
+    printOperandWarning(messages, "scalar integer", i, ty, opNum);
     return false;
   }
   return true;
 }
 
-bool checkOperandTypeIsScalarIntOrPointer(const Instruction *i,
-                                          unsigned opNum) {
+bool checkOperandTypeIsScalarIntOrPointer(std::vector<std::string> &messages,
+                                          const Instruction *i, unsigned opNum) {
   assert(opNum < i->getNumOperands());
   llvm::Type *ty = i->getOperand(opNum)->getType();
   if (!(ty->isIntegerTy() || ty->isPointerTy())) {
-    printOperandWarning("scalar integer or pointer", i, ty, opNum);
+    printOperandWarning(messages, "scalar integer or pointer", i, ty, opNum);
     return false;
   }
   return true;
 }
 
-bool checkOperandTypeIsScalarPointer(const Instruction *i, unsigned opNum) {
+bool checkOperandTypeIsScalarPointer(std::vector<std::string> &messages,
+                                     const Instruction *i, unsigned opNum) {
   assert(opNum < i->getNumOperands());
   llvm::Type *ty = i->getOperand(opNum)->getType();
   if (!(ty->isPointerTy())) {
-    printOperandWarning("scalar pointer", i, ty, opNum);
+    printOperandWarning(messages, "scalar pointer", i, ty, opNum);
     return false;
   }
   return true;
 }
 
-bool checkOperandTypeIsScalarFloat(const Instruction *i, unsigned opNum) {
+bool checkOperandTypeIsScalarFloat(std::vector<std::string> &messages,
+                                   const Instruction *i, unsigned opNum) {
   assert(opNum < i->getNumOperands());
   llvm::Type *ty = i->getOperand(opNum)->getType();
   if (!(ty->isFloatingPointTy())) {
-    printOperandWarning("scalar float", i, ty, opNum);
+    printOperandWarning(messages, "scalar float", i, ty, opNum);
     return false;
   }
   return true;
 }
 
-bool checkOperandsHaveSameType(const Instruction *i, unsigned opNum0,
+bool checkOperandsHaveSameType(std::vector<std::string> &messages,
+                               const Instruction *i, unsigned opNum0,
                                unsigned opNum1) {
   assert(opNum0 < i->getNumOperands());
   assert(opNum1 < i->getNumOperands());
@@ -80,22 +84,26 @@ bool checkOperandsHaveSameType(const Instruction *i, unsigned opNum0,
        << ") for operands" << opNum0 << " and " << opNum1
        << ". Expected operand types to match in " << *i;
     i->print(ss);
-    ss.flush();
-    linker::linker_message("%s", msg.c_str());
+    messages.push_back(std::move(ss.str()));
     return false;
   }
   return true;
 }
 
-bool checkInstruction(const Instruction *i) {
+bool checkInstruction(std::vector<std::string> &messages,
+                      const Instruction *i, bool allowNativeVectors) {
+  if (allowNativeVectors &&
+      linker::SelectiveScalarizerPass::isNativeVectorInstruction(*i))
+    return true;
+
   switch (i->getOpcode()) {
   case Instruction::Select: {
     // Note we do not enforce that operand 1 and 2 are scalar because the
     // scalarizer pass might not remove these. This could be selecting which
     // vector operand to feed to another instruction. The Executor can handle
     // this so case so this is not a problem
-    return checkOperandTypeIsScalarInt(i, 0) &
-           checkOperandsHaveSameType(i, 1, 2);
+    return checkOperandTypeIsScalarInt(messages, i, 0) &
+           checkOperandsHaveSameType(messages, i, 1, 2);
   }
   // Integer arithmetic, logical and shifting
   case Instruction::Add:
@@ -111,23 +119,23 @@ bool checkInstruction(const Instruction *i) {
   case Instruction::Shl:
   case Instruction::LShr:
   case Instruction::AShr: {
-    return checkOperandTypeIsScalarInt(i, 0) &
-           checkOperandTypeIsScalarInt(i, 1);
+    return checkOperandTypeIsScalarInt(messages, i, 0) &
+           checkOperandTypeIsScalarInt(messages, i, 1);
   }
   // Integer comparison
   case Instruction::ICmp: {
-    return checkOperandTypeIsScalarIntOrPointer(i, 0) &
-           checkOperandTypeIsScalarIntOrPointer(i, 1);
+    return checkOperandTypeIsScalarIntOrPointer(messages, i, 0) &
+           checkOperandTypeIsScalarIntOrPointer(messages, i, 1);
   }
   // Integer Conversion
   case Instruction::Trunc:
   case Instruction::ZExt:
   case Instruction::SExt:
   case Instruction::IntToPtr: {
-    return checkOperandTypeIsScalarInt(i, 0);
+    return checkOperandTypeIsScalarInt(messages, i, 0);
   }
   case Instruction::PtrToInt: {
-    return checkOperandTypeIsScalarPointer(i, 0);
+    return checkOperandTypeIsScalarPointer(messages, i, 0);
   }
   // TODO: Figure out if Instruction::BitCast needs checking
   // Floating point arithmetic
@@ -136,24 +144,24 @@ bool checkInstruction(const Instruction *i) {
   case Instruction::FMul:
   case Instruction::FDiv:
   case Instruction::FRem: {
-    return checkOperandTypeIsScalarFloat(i, 0) &
-           checkOperandTypeIsScalarFloat(i, 1);
+    return checkOperandTypeIsScalarFloat(messages, i, 0) &
+           checkOperandTypeIsScalarFloat(messages, i, 1);
   }
   // Floating point conversion
   case Instruction::FPTrunc:
   case Instruction::FPExt:
   case Instruction::FPToUI:
   case Instruction::FPToSI: {
-    return checkOperandTypeIsScalarFloat(i, 0);
+    return checkOperandTypeIsScalarFloat(messages, i, 0);
   }
   case Instruction::UIToFP:
   case Instruction::SIToFP: {
-    return checkOperandTypeIsScalarInt(i, 0);
+    return checkOperandTypeIsScalarInt(messages, i, 0);
   }
   // Floating point comparison
   case Instruction::FCmp: {
-    return checkOperandTypeIsScalarFloat(i, 0) &
-           checkOperandTypeIsScalarFloat(i, 1);
+    return checkOperandTypeIsScalarFloat(messages, i, 0) &
+           checkOperandTypeIsScalarFloat(messages, i, 1);
   }
   default:
     // Treat all other instructions as conforming
@@ -164,20 +172,32 @@ bool checkInstruction(const Instruction *i) {
 
 namespace linker {
 
-char InstructionOperandTypeCheckPass::ID = 0;
+bool InstructionOperandTypeCheckPass::checkFunction(
+    const Function &F, std::vector<std::string> &messages,
+    bool allowNativeVectors) {
+  bool conform = true;
+  for (const BasicBlock &bb : F)
+    for (const Instruction &i : bb)
+      conform &= checkInstruction(messages, &i, allowNativeVectors);
+  return conform;
+}
 
 bool InstructionOperandTypeCheckPass::runOnModule(Module &M) {
   instructionOperandsConform = true;
   for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
-    for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
-      for (BasicBlock::iterator ii = bi->begin(), ie = bi->end(); ii != ie;
-           ++ii) {
-        Instruction *i = &*ii;
-        instructionOperandsConform &= checkInstruction(i);
-      }
-    }
+    std::vector<std::string> messages;
+    instructionOperandsConform &=
+        checkFunction(*fi, messages, allowNativeVectors);
+    for (const std::string &msg : messages)
+      linker::linker_message("%s", msg.c_str());
   }
 
   return false;
 }
+
+PreservedAnalyses InstructionOperandTypeCheckPass::run(Module &M,
+                                                       ModuleAnalysisManager &) {
+  runOnModule(M);
+  return PreservedAnalyses::all();
+}
 }
@@ -34,8 +34,6 @@ using namespace llvm;
 
 namespace linker {
 
-char IntrinsicCleanerPass::ID;
-
 bool IntrinsicCleanerPass::runOnModule(Module &M) {
   bool dirty = false;
   for (Module::iterator f = M.begin(), fe = M.end(); f != fe; ++f)
@@ -49,6 +47,11 @@ bool IntrinsicCleanerPass::runOnModule(Module &M) {
   return dirty;
 }
 
+PreservedAnalyses IntrinsicCleanerPass::run(Module &M,
+                                            ModuleAnalysisManager &) {
+  return runOnModule(M) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
 bool IntrinsicCleanerPass::runOnBasicBlock(BasicBlock &b, Module &M) {
   bool dirty = false;
   LLVMContext &ctx = M.getContext();
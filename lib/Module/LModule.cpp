@@ -7,14 +7,13 @@
 //
 //===----------------------------------------------------------------------===//
 
-#define DEBUG_TYPE "LModule"
-
 #include "Passes.h"
 
 #include "fs-linker/Config/Version.h"
 #include "fs-linker/Support/Utils.h"
 #include "fs-linker/Module/LModule.h"
 #include "fs-linker/Module/ModuleUtil.h"
+#include "fs-linker/Module/PostDominators.h"
 
 #include "llvm/Bitcode/BitcodeWriter.h"
 #if LLVM_VERSION_CODE < LLVM_VERSION(8, 0)
@@ -23,30 +22,39 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/TypeFinder.h"
 #include "llvm/IR/ValueSymbolTable.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Linker/Linker.h"
+#if LLVM_VERSION_CODE >= LLVM_VERSION(14, 0)
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/raw_os_ostream.h"
-#include "llvm/Transforms/Scalar.h"
-#if LLVM_VERSION_CODE >= LLVM_VERSION(8, 0)
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Scalar/LowerAtomic.h"
 #include "llvm/Transforms/Scalar/Scalarizer.h"
-#endif
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
 #include "llvm/Transforms/Utils/Cloning.h"
-#if LLVM_VERSION_CODE >= LLVM_VERSION(7, 0)
-#include "llvm/Transforms/Utils.h"
-#endif
+#include "llvm/Transforms/Utils/LowerSwitch.h"
 
 #include <sstream>
 
 using namespace llvm;
 using namespace linker;
 
+#define DEBUG_TYPE "LModule"
+
 namespace linker {
 cl::OptionCategory
     ModuleCat("Module-related options",
@@ -77,26 +85,227 @@ namespace {
              cl::desc("Do not verify the module integrity (default=false)"),
              cl::init(false), cl::cat(linker::ModuleCat));
 
+  cl::opt<bool>
+  VerifyEach("verify-each",
+             cl::desc("Verify intermediate results of all optimization "
+                      "passes (default=false)"),
+             cl::init(false), cl::cat(linker::ModuleCat));
+
   cl::opt<bool>
   OptimiseEngineCall("engine-call-optimisation",
                              cl::desc("Allow optimization of functions that "
                                       "contain Engine calls (default=true)"),
                              cl::init(true), cl::cat(ModuleCat));
 
+  enum OptNoneGranularity {
+    eOptNoneFunction,
+    eOptNoneRegion
+  };
+
+  cl::opt<OptNoneGranularity>
+  OptNoneGranularityOpt("optnone-granularity",
+                        cl::desc("Select what is kept unoptimized around "
+                                 "Engine calls when "
+                                 "--engine-call-optimisation=false "
+                                 "(default=function)"),
+                        cl::values(clEnumValN(eOptNoneFunction, "function",
+                                              "the whole calling function"),
+                                   clEnumValN(eOptNoneRegion, "region",
+                                              "only the calls, outlined into "
+                                              "their own function")),
+                        cl::init(eOptNoneFunction), cl::cat(ModuleCat));
+
+  cl::opt<std::string>
+  EngineProfile("engine-profile",
+                cl::desc("Per-function profile of earlier Engine runs with "
+                         "one 'name count' line per function, used to steer "
+                         "inlining and optnone"),
+                cl::value_desc("file"), cl::init(""), cl::cat(ModuleCat));
+
+  cl::opt<unsigned>
+  EngineProfileHotPercent("engine-profile-hot-percent",
+                          cl::desc("Share of the profile counts covered by "
+                                   "the functions marked hot (default=90)"),
+                          cl::init(90), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  PreserveVectors("preserve-vectors",
+                  cl::desc("Only scalarize the vector instructions the Engine "
+                           "cannot execute natively, keeping vector loads, "
+                           "stores and integer operations (default=false)"),
+                  cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  CleanupModule("cleanup",
+                cl::desc("Without --optimize, remove unused globals, merge "
+                         "duplicate constants, promote allocas to registers "
+                         "and mark globals that are never written constant, "
+                         "keeping the branches of the program (default=false)"),
+                cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  LoopIdiom("loop-idiom",
+            cl::desc("Turn copy and fill loops into memcpy and memset, also "
+                     "without --optimize (default=false)"),
+            cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  MergeFunctions("merge-functions",
+                 cl::desc("Replace functions that are identical up to "
+                          "pointer types with a single copy (default=false)"),
+                 cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  SpecializeConstantArgs("specialize-constant-args",
+                         cl::desc("Clone functions for the integer constants "
+                                  "they are repeatedly called with and fold "
+                                  "the branches on them (default=false)"),
+                         cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<unsigned>
+  SpecializeMaxClones("specialize-max-clones",
+                      cl::desc("Maximum number of clones made by "
+                               "--specialize-constant-args (default=100)"),
+                      cl::init(100), cl::cat(ModuleCat));
+
+  cl::list<std::string>
+  ReplaceLibc("replace-libc",
+              cl::desc("Routines to take from the library given with "
+                       "--string-lib, e.g. strcmp,memcpy (default=all it "
+                       "provides)"),
+              cl::CommaSeparated, cl::value_desc("name"), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  MarkConcreteOnly("mark-concrete-only",
+                   cl::desc("Mark the functions that never touch symbolic "
+                            "data with the fs-concrete-only attribute "
+                            "(default=false)"),
+                   cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<std::string>
+  ConcreteOnlyList("concrete-only-list",
+                   cl::desc("Write the names of the functions that never "
+                            "touch symbolic data to the file, implies "
+                            "--mark-concrete-only"),
+                   cl::value_desc("file"), cl::init(""), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  IfConvert("if-convert",
+            cl::desc("Flatten small side-effect-free diamonds and triangles "
+                     "of the control flow into selects (default=false)"),
+            cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<unsigned>
+  IfConvertThreshold("if-convert-threshold",
+                     cl::desc("Maximum number of instructions --if-convert "
+                              "speculates per branch (default=4)"),
+                     cl::init(4), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  NarrowIntWidth("narrow-int-width",
+                 cl::desc("Narrow integer arithmetic and comparisons to the "
+                          "smallest width that preserves their results "
+                          "(default=false)"),
+                 cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  PointsTo("points-to",
+           cl::desc("Annotate loads and stores with the allocation sites "
+                    "they may access (!fs.pts) (default=false)"),
+           cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<std::string>
+  PointsToTable("points-to-table",
+                cl::desc("Write the allocation sites numbered by --points-to "
+                         "to the file, one id,kind,function,name line per "
+                         "site, implies --points-to"),
+                cl::value_desc("file"), cl::init(""), cl::cat(ModuleCat));
+
+  cl::opt<bool>
+  LoopMetadata("loop-metadata",
+               cl::desc("Annotate loop headers, loop exits, trip counts and "
+                        "induction variables for the Engine (default=false)"),
+               cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<std::string>
+  LoopMetadataFile("loop-metadata-file",
+                   cl::desc("Write the loops found by --loop-metadata to the "
+                            "file as JSON, implies --loop-metadata"),
+                   cl::value_desc("file"), cl::init(""), cl::cat(ModuleCat));
+
+  cl::opt<std::string>
+  ComplexityReportFile("complexity-report",
+                       cl::desc("Write per-function counts of branches, "
+                                "switch cases, loops, indirect calls, inline "
+                                "asm, floating point operations and Engine "
+                                "calls to the file as CSV"),
+                       cl::value_desc("file"), cl::init(""),
+                       cl::cat(ModuleCat));
+
   cl::opt<bool>
   NoDCE("no-dce",
              cl::desc("Disable the built-in DCE (default=false)"),
              cl::init(false), cl::cat(linker::ModuleCat));
+
+  cl::opt<bool>
+  EvaluateStartup("evaluate-startup",
+                  cl::desc("Run static constructors and the deterministic "
+                           "part of the libc initialization at link time "
+                           "(default=false)"),
+                  cl::init(false), cl::cat(ModuleCat));
+
+  cl::opt<std::string>
+  PostDominatorsFile("post-dominators-file",
+                     cl::desc("Write the immediate post-dominators and "
+                              "control dependences of every function to the "
+                              "file in the binary FSPD format"),
+                     cl::value_desc("file"), cl::init(""),
+                     cl::cat(linker::ModuleCat));
+
+  cl::opt<unsigned>
+  CheckThreads("check-threads",
+               cl::desc("Number of threads used to verify and type check "
+                        "the final module, 0 uses all cores (default=0)"),
+               cl::init(0), cl::cat(linker::ModuleCat));
 }
 
 /***/
 
 namespace llvm {
-extern void Optimize(Module *, llvm::ArrayRef<const char *> preservedFunctions);
+extern void Optimize(Module *, llvm::ArrayRef<const char *> preservedFunctions,
+                     linker::PassContext &);
+extern void Cleanup(Module *, linker::PassContext &);
+extern void RecognizeLoopIdioms(Module *, linker::PassContext &);
 }
 
+PassContext::PassContext(bool VerifyEach)
+    : SI(/*DebugLogging=*/false, VerifyEach), VerifyEach(VerifyEach) {
+  SI.registerCallbacks(PIC, &FAM);
+
+  PassBuilder PB(nullptr, PipelineTuningOptions(), None, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+}
+
+void PassContext::clear() {
+  LAM.clear();
+  FAM.clear();
+  CGAM.clear();
+  MAM.clear();
+}
+
+LModule::LModule() : passes(new PassContext(VerifyEach)) {}
+
+LModule::~LModule() = default;
+
 bool LModule::link(std::vector<std::unique_ptr<llvm::Module>> &modules,
                    const std::string &entryPoint) {
+  // Linking frees and creates IR, so none of the cached results stay valid.
+  passes->clear();
+
   auto numRemainingModules = modules.size();
   // Add the currently active module to the list of linkables
   if (module) modules.push_back(std::move(module));
@@ -112,90 +321,369 @@ bool LModule::link(std::vector<std::unique_ptr<llvm::Module>> &modules,
   return modules.size() != numRemainingModules;
 }
 
+// Returns the target machine for the module's target triple, or null if the
+// target is not available.
+static TargetMachine *createTargetMachine(const Module &m) {
+  // Use target triple from the module if possible.
+  std::string TargetTriple = m.getTargetTriple();
+  if (TargetTriple.empty())
+    TargetTriple = llvm::sys::getDefaultTargetTriple();
+
+  std::string Err;
+  const Target *Target = TargetRegistry::lookupTarget(TargetTriple, Err);
+  if (!Target) {
+    linker_message("Warning: unable to select target: %s", Err.c_str());
+    return nullptr;
+  }
+  return Target->createTargetMachine(TargetTriple, "", "", TargetOptions(),
+                                     None);
+}
+
 void LModule::instrument(const linker::ModuleOptions &opts) {
+  // The module is instrumented again after each round of linking, while
+  // the target stays the same.
+  if (!targetMachine)
+    targetMachine.reset(createTargetMachine(*module));
+
   // Inject checks prior to optimization... we also perform the
   // invariant transformations that we will end up doing later so that
   // optimize is seeing what is as close as possible to the final
   // module.
-  legacy::PassManager pm;
-  pm.add(new RaiseAsmPass());
+  ModulePassManager pm;
+  pm.addPass(RaiseAsmPass(targetMachine.get()));
 
+  FunctionPassManager fpm;
   // This pass will scalarize as much code as possible so that the Linker
   // does not need to handle operands of vector type for most instructions
   // other than InsertElementInst and ExtractElementInst.
   //
   // NOTE: Must come before division/overshift checks because those passes
   // don't know how to handle vector instructions.
-  pm.add(createScalarizerPass());
+  if (PreserveVectors)
+    fpm.addPass(
+        SelectiveScalarizerPass(opts.CheckDivZero, opts.CheckOvershift));
+  else
+    fpm.addPass(ScalarizerPass());
 
   // This pass will replace atomic instructions with non-atomic operations
-  pm.add(createLowerAtomicPass());
+  fpm.addPass(LowerAtomicPass());
+  pm.addPass(createModuleToFunctionPassAdaptor(std::move(fpm)));
+
+  if (opts.CheckDivZero)
+    pm.addPass(DivCheckPass());
+  if (opts.CheckOvershift)
+    pm.addPass(OvershiftCheckPass());
+
+  pm.addPass(IntrinsicCleanerPass(*targetData));
+  pm.run(*module, passes->MAM);
+}
+
+// Returns a function calling the functions of a llvm.global_ctors or
+// llvm.global_dtors list in the order they are supposed to run.
+static Function *getStubFunctionForCtorList(Module *m, GlobalVariable *gv,
+                                            std::string name, bool reverse) {
+  std::vector<Type *> nullary;
+  Function *fn = Function::Create(
+      FunctionType::get(Type::getVoidTy(m->getContext()), nullary, false),
+      GlobalVariable::InternalLinkage, name, m);
+  BasicBlock *bb = BasicBlock::Create(m->getContext(), "entry", fn);
+  llvm::IRBuilder<> Builder(bb);
+
+  std::vector<ConstantStruct *> entries = getCtorListByPriority(gv);
+  if (reverse)
+    std::reverse(entries.begin(), entries.end());
+  for (ConstantStruct *cs : entries) {
+    // There is a third element in global_ctor elements (``i8 @data``), the
+    // function pointer is the second one.
+    Constant *fp = cs->getOperand(1)->stripPointerCasts();
+    if (fp->isNullValue())
+      continue;
+    if (auto f = dyn_cast<Function>(fp))
+      Builder.CreateCall(f);
+    else
+      linker_error("unable to get function pointer from ctor initializer "
+                   "list");
+  }
+  Builder.CreateRetVoid();
+  return fn;
+}
 
-  // Todo: add DivCheckPass and OvershiftCheckPass
+// The engine does not run static constructors and destructors itself, so
+// call the constructors on entry and the destructors before returning.
+static void injectStaticConstructorsAndDestructors(Module *m,
+                                                   StringRef entryFunction) {
+  GlobalVariable *ctors = m->getNamedGlobal("llvm.global_ctors");
+  GlobalVariable *dtors = m->getNamedGlobal("llvm.global_dtors");
 
-  pm.add(new IntrinsicCleanerPass(*targetData));
-  pm.run(*module);
+  if (!ctors && !dtors)
+    return;
+
+  Function *mainFn = m->getFunction(entryFunction);
+  if (!mainFn)
+    linker_error("Entry function '%s' not found in module.",
+                 entryFunction.str().c_str());
+
+  if (ctors) {
+    llvm::IRBuilder<> Builder(&*mainFn->getEntryBlock().getFirstInsertionPt());
+    Builder.CreateCall(
+        getStubFunctionForCtorList(m, ctors, "fs.ctor_stub", false));
+    ctors->eraseFromParent();
+  }
+
+  if (dtors) {
+    Function *dtorStub =
+        getStubFunctionForCtorList(m, dtors, "fs.dtor_stub", true);
+    for (auto it = mainFn->begin(), ie = mainFn->end(); it != ie; ++it) {
+      if (isa<ReturnInst>(it->getTerminator())) {
+        llvm::IRBuilder<> Builder(it->getTerminator());
+        Builder.CreateCall(dtorStub);
+      }
+    }
+    dtors->eraseFromParent();
+  }
 }
 
 void LModule::optimiseAndPrepare(
     const linker::ModuleOptions &opts,
     llvm::ArrayRef<const char *> preservedFunctions) {
+  // Linking renames the struct types it cannot match up with an existing
+  // type, even if they turn out to be identical. This rewrites the whole
+  // module, so it is done once all rounds of linking are over.
+  {
+    ModulePassManager pm;
+    pm.addPass(MergeStructTypesPass());
+    pm.run(*module, passes->MAM);
+  }
+
+  // Run what does not depend on the input of the program's initialization
+  // now rather than on every path.
+  if (EvaluateStartup) {
+    ModulePassManager pm;
+    pm.addPass(StartupEvaluatorPass(opts.EntryPoint));
+    pm.run(*module, passes->MAM);
+  }
+  injectStaticConstructorsAndDestructors(module.get(), opts.EntryPoint);
+
+  // Inline what earlier runs spent their time in and leave alone what they
+  // never reached.
+  if (!EngineProfile.empty()) {
+    ModulePassManager pm;
+    pm.addPass(EngineProfilePass(EngineProfile, EngineProfileHotPercent));
+    pm.run(*module, passes->MAM);
+  }
+
   // Preserve all functions containing execution engine-related function calls from being
   // optimised around
   if (!OptimiseEngineCall) {
-    legacy::PassManager pm;
-    pm.add(new OptNonePass());
-    pm.run(*module);
+    ModulePassManager pm;
+    pm.addPass(OptNonePass(OptNoneGranularityOpt == eOptNoneRegion));
+    pm.run(*module, passes->MAM);
   }
 
-  if (opts.Optimize)
-    Optimize(module.get(), preservedFunctions);
-
-  // Add internal functions which are not used to check if instructions
-  // have been already visited
-  // Todo: add opts.CheckDivZero and opts.CheckOvershift support
+  // Fold the flags that runtime functions are called with before the
+  // optimizer looks at them.
+  if (SpecializeConstantArgs) {
+    ModulePassManager pm;
+    pm.addPass(SpecializeConstantArgsPass(SpecializeMaxClones));
+    pm.run(*module, passes->MAM);
+  }
 
-  // Todo: add injectStaticConstructorsAndDestructors support for ctors/dtors
-  GlobalVariable *ctors = module->getNamedGlobal("llvm.global_ctors");
-  GlobalVariable *dtors = module->getNamedGlobal("llvm.global_dtors");
+  if (opts.Optimize)
+    Optimize(module.get(), preservedFunctions, *passes);
+  else if (CleanupModule)
+    Cleanup(module.get(), *passes);
+  if (LoopIdiom)
+    RecognizeLoopIdioms(module.get(), *passes);
 
-  if (ctors || dtors)
-    linker_error("llvm.global_ctors and llvm.global_dtors not supported");
+  if (MergeFunctions) {
+    ModulePassManager pm;
+    pm.addPass(linker::MergeFunctionsPass(preservedFunctions));
+    pm.run(*module, passes->MAM);
+  }
 
   // Finally, run the passes that maintain invariants we expect during
   // interpretation. We run the intrinsic cleaner just in case we
   // linked in something with intrinsics but any external calls are
   // going to be unresolved. We really need to handle the intrinsics
   // directly I think?
-  legacy::PassManager pm3;
-  pm3.add(createCFGSimplificationPass());
+  // Switches are counted before --switch-type lowers them.
+  ComplexityReport complexity;
+  if (!ComplexityReportFile.empty())
+    complexity.recordSwitches(*module);
+
+  ModulePassManager pm3;
+  FunctionPassManager fpm3;
+  // --cleanup keeps the branches that mem2reg left joined by phis.
+  if (!opts.Optimize && CleanupModule)
+    fpm3.addPass(SimplifyCFGPass(getBranchPreservingSimplifyCFGOptions()));
+  else
+    fpm3.addPass(SimplifyCFGPass());
   switch(SwitchType) {
   case eSwitchTypeInternal: break;
-  case eSwitchTypeSimple: pm3.add(new LowerSwitchPass()); break;
-  case eSwitchTypeLLVM:  pm3.add(createLowerSwitchPass()); break;
+  case eSwitchTypeSimple: fpm3.addPass(linker::LowerSwitchPass()); break;
+  case eSwitchTypeLLVM:  fpm3.addPass(llvm::LowerSwitchPass()); break;
   default: linker_error("invalid --switch-type");
   }
-  pm3.add(new IntrinsicCleanerPass(*targetData));
-  pm3.add(createScalarizerPass());
-  pm3.add(new PhiCleanerPass());
-  pm3.add(new FunctionAliasPass());
-  pm3.run(*module);
+  // After the switches are lowered, which decides how they fork, so that
+  // the branches they were lowered to are seen as they will be run.
+  if (IfConvert)
+    fpm3.addPass(IfConvertPass(IfConvertThreshold));
+  pm3.addPass(createModuleToFunctionPassAdaptor(std::move(fpm3)));
+  pm3.addPass(IntrinsicCleanerPass(*targetData));
+  // Redirect libc routines to the string runtime, if it was linked in. This
+  // runs after the optimizer, which may introduce new calls of them.
+  pm3.addPass(ReplaceLibcPass(
+      std::vector<std::string>(ReplaceLibc.begin(), ReplaceLibc.end())));
+  FunctionPassManager fpm4;
+  if (PreserveVectors)
+    fpm4.addPass(SelectiveScalarizerPass());
+  else
+    fpm4.addPass(ScalarizerPass());
+  // After the scalarizer, which leaves more scalar arithmetic to narrow.
+  if (NarrowIntWidth)
+    fpm4.addPass(NarrowIntWidthPass());
+  fpm4.addPass(PhiCleanerPass());
+  pm3.addPass(createModuleToFunctionPassAdaptor(std::move(fpm4)));
+  pm3.addPass(FunctionAliasPass());
+  // Done last, so that the Engine gets the list for the code it runs.
+  if (MarkConcreteOnly || !ConcreteOnlyList.empty())
+    pm3.addPass(ConcreteOnlyPass(ConcreteOnlyList));
+  if (PointsTo || !PointsToTable.empty())
+    pm3.addPass(PointsToPass(PointsToTable));
+  if (LoopMetadata || !LoopMetadataFile.empty())
+    pm3.addPass(LoopMetadataPass(LoopMetadataFile));
+  pm3.run(*module, passes->MAM);
+
+  if (!ComplexityReportFile.empty())
+    complexity.write(*module, passes->FAM, ComplexityReportFile);
+
+  // No module is instrumented after this point.
+  stripCheckMarkers(*module);
+}
+
+// Verifies the function bodies of M and checks their operand types on a
+// thread pool. Both checks mostly read the function they look at, with two
+// exceptions: Type::isSized() caches its answer in the struct types, which
+// are shared by all functions, so every struct type is sized here first; and
+// the verifier may create the mangled name of an overloaded intrinsic in the
+// module, so functions calling one are checked on this thread. Diagnostics
+// are buffered per function and printed in module order afterwards.
+static bool checkModuleInParallel(Module &M, bool verify, unsigned threads) {
+  struct FunctionResult {
+    std::string verifierErrors;
+    std::vector<std::string> typeErrors;
+    bool broken = false;
+    bool conform = true;
+  };
+
+  std::vector<Function *> functions;
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      functions.push_back(&F);
+
+  TypeFinder structTypes;
+  structTypes.run(M, false);
+  for (StructType *ST : structTypes)
+    ST->isSized();
+
+  SmallPtrSet<const Function *, 16> serial;
+  for (Function &F : M)
+    if (F.isIntrinsic() && Intrinsic::isOverloaded(F.getIntrinsicID()))
+      for (const User *U : F.users())
+        if (const auto *I = dyn_cast<Instruction>(U))
+          serial.insert(I->getFunction());
+
+  std::vector<FunctionResult> results(functions.size());
+  auto check = [&](size_t i) {
+    FunctionResult &R = results[i];
+    if (verify) {
+      raw_string_ostream os(R.verifierErrors);
+      R.broken = verifyFunction(*functions[i], &os);
+    }
+    R.conform =
+        InstructionOperandTypeCheckPass::checkFunction(*functions[i],
+                                                       R.typeErrors,
+                                                       PreserveVectors);
+  };
+
+  {
+    ThreadPool pool(hardware_concurrency(threads));
+    for (size_t i = 0; i < functions.size(); ++i)
+      if (!serial.count(functions[i]))
+        pool.async(check, i);
+    for (size_t i = 0; i < functions.size(); ++i)
+      if (serial.count(functions[i]))
+        check(i);
+    pool.wait();
+  }
+
+  bool broken = false, conform = true;
+  for (const FunctionResult &R : results) {
+    if (R.broken) {
+      errs() << R.verifierErrors;
+      broken = true;
+    }
+    for (const std::string &msg : R.typeErrors)
+      linker_message("%s", msg.c_str());
+    conform &= R.conform;
+  }
+
+  if (verify) {
+    // The module level invariants (globals, aliases, named metadata) are
+    // checked on a copy of the module without function bodies, so that the
+    // bodies are not verified a second time.
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> skeleton = CloneModule(
+        M, VMap, [](const GlobalValue *GV) { return !isa<Function>(GV); });
+    for (Function &F : *skeleton)
+      if (F.isDeclaration())
+        F.setComdat(nullptr);
+    // Aliases must point to a definition, so give the functions an
+    // unreachable body in place of the one that was left out.
+    for (Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      auto *copy = cast<Function>(VMap[&F]);
+      new UnreachableInst(M.getContext(),
+                          BasicBlock::Create(M.getContext(), "", copy));
+      copy->setLinkage(F.getLinkage());
+    }
+    broken |= verifyModule(*skeleton, &errs());
+  }
+
+  if (broken)
+    report_fatal_error("Broken module found, compilation aborted!");
+  return conform;
 }
 
 void LModule::checkModule() {
-  InstructionOperandTypeCheckPass *operandTypeCheckPass =
-      new InstructionOperandTypeCheckPass();
+  if (CheckThreads != 1) {
+    // Enforce the operand type invariants that the Solver expects.
+    if (!checkModuleInParallel(*module, !DontVerify, CheckThreads))
+      linker_error("Unexpected instruction operand types detected");
+    return;
+  }
+
+  if (!DontVerify) {
+    ModulePassManager pm;
+    pm.addPass(VerifierPass());
+    pm.run(*module, passes->MAM);
+  }
 
-  legacy::PassManager pm;
-  if (!DontVerify)
-    pm.add(createVerifierPass());
-  pm.add(operandTypeCheckPass);
-  pm.run(*module);
+  // The result of the operand type check is queried below, so the pass is
+  // run directly rather than handed over to a pass manager.
+  InstructionOperandTypeCheckPass operandTypeCheckPass(PreserveVectors);
+  operandTypeCheckPass.run(*module, passes->MAM);
 
   // Enforce the operand type invariants that the Solver expects.  This
   // implicitly depends on the "Scalarizer" pass to be run in order to succeed
   // in the presence of vector instructions.
-  if (!operandTypeCheckPass->checkPassed()) {
+  if (!operandTypeCheckPass.checkPassed()) {
     linker_error("Unexpected instruction operand types detected");
   }
 }
+
+void LModule::exportAnalyses() {
+  if (!PostDominatorsFile.empty())
+    writePostDominators(*module, PostDominatorsFile);
+}
@@ -147,8 +147,15 @@ Linker::setModule(std::vector<std::unique_ptr<llvm::Module>> &modules,
   preservedFunctions.push_back("memcmp");
   preservedFunctions.push_back("memmove");
 
+  // Preserve the checks injected by LModule::instrument
+  if (opts.CheckDivZero)
+    preservedFunctions.push_back("klee_div_zero_check");
+  if (opts.CheckOvershift)
+    preservedFunctions.push_back("klee_overshift_check");
+
   lmodule->optimiseAndPrepare(opts, preservedFunctions);
   lmodule->checkModule();
+  lmodule->exportAnalyses();
 
   return lmodule->module.get();
 }
@@ -0,0 +1,211 @@
+//===-- LoopMetadata.cpp --------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Records the loops of the final module, so that the Engine's loop bounding
+// and state merging do not have to rediscover them while it runs. Loops are
+// numbered across the module, outer loops before the loops they contain.
+//
+//  - The terminator of a loop header gets
+//    !fs.loop !{i32 <id>, i32 <parent id or -1>, !"<trip kind>", i64 <n>}
+//    where the trip kind is "constant" with n the trip count, "symbolic"
+//    when the trip count is an expression of values of the program with n
+//    its constant upper bound or 0, or "unknown".
+//  - The terminator of a block leaving loops gets
+//    !fs.loop.exit !{i32 <id>, ...} listing the loops it leaves.
+//  - A header phi that is an induction variable with a constant step gets
+//    !fs.loop.iv !{i32 <id>, i64 <step>}.
+//
+// The same facts can be written to a JSON sidecar, with the trip count and
+// the induction variables as the expressions ScalarEvolution found.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "loop-metadata"
+
+ALWAYS_ENABLED_STATISTIC(NumLoops, "Number of loops annotated");
+ALWAYS_ENABLED_STATISTIC(NumConstantTripCounts,
+                         "Number of loops with a constant trip count");
+ALWAYS_ENABLED_STATISTIC(NumSymbolicTripCounts,
+                         "Number of loops with a symbolic trip count");
+ALWAYS_ENABLED_STATISTIC(NumInductionVariables,
+                         "Number of induction variables annotated");
+
+namespace {
+
+std::string toString(const Value &V) {
+  std::string S;
+  raw_string_ostream OS(S);
+  V.printAsOperand(OS, false);
+  return OS.str();
+}
+
+std::string toString(const SCEV &S) {
+  std::string Str;
+  raw_string_ostream OS(Str);
+  S.print(OS);
+  return OS.str();
+}
+
+} // namespace
+
+namespace linker {
+
+bool LoopMetadataPass::runOnModule(Module &M, FunctionAnalysisManager &FAM) {
+  LLVMContext &ctx = M.getContext();
+  Type *i32 = Type::getInt32Ty(ctx), *i64 = Type::getInt64Ty(ctx);
+  unsigned loopKind = ctx.getMDKindID("fs.loop");
+  unsigned exitKind = ctx.getMDKindID("fs.loop.exit");
+  unsigned ivKind = ctx.getMDKindID("fs.loop.iv");
+  auto constant = [&](Type *T, int64_t value) {
+    return ConstantAsMetadata::get(ConstantInt::get(T, value, true));
+  };
+
+  std::unique_ptr<raw_fd_ostream> file;
+  std::unique_ptr<json::OStream> sidecar;
+  if (!sidecarFile.empty()) {
+    std::error_code EC;
+    file = std::make_unique<raw_fd_ostream>(sidecarFile, EC, sys::fs::OF_Text);
+    if (EC)
+      linker_error("Unable to open '%s': %s", sidecarFile.c_str(),
+                   EC.message().c_str());
+    sidecar = std::make_unique<json::OStream>(*file, 2);
+    sidecar->arrayBegin();
+  }
+
+  unsigned nextId = 0;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    if (LI.empty())
+      continue;
+    ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+
+    DenseMap<const Loop *, unsigned> ids;
+    DenseMap<Instruction *, SmallVector<Metadata *, 2>> exits;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      unsigned id = nextId++;
+      ids[L] = id;
+      Loop *parent = L->getParentLoop();
+      int parentId = parent ? (int)ids.lookup(parent) : -1;
+
+      StringRef tripKind = "unknown";
+      uint64_t trips = 0;
+      const SCEV *backedges = SE.getBackedgeTakenCount(L);
+      if (unsigned count = SE.getSmallConstantTripCount(L)) {
+        tripKind = "constant";
+        trips = count;
+        ++NumConstantTripCounts;
+      } else if (!isa<SCEVCouldNotCompute>(backedges)) {
+        tripKind = "symbolic";
+        trips = SE.getSmallConstantMaxTripCount(L);
+        ++NumSymbolicTripCounts;
+      }
+
+      BasicBlock *header = L->getHeader();
+      header->getTerminator()->setMetadata(
+          loopKind, MDNode::get(ctx, {constant(i32, id),
+                                      constant(i32, parentId),
+                                      MDString::get(ctx, tripKind),
+                                      constant(i64, trips)}));
+      ++NumLoops;
+
+      SmallVector<BasicBlock *, 4> exiting;
+      L->getExitingBlocks(exiting);
+      for (BasicBlock *BB : exiting)
+        exits[BB->getTerminator()].push_back(constant(i32, id));
+
+      // Induction variables: header phis ScalarEvolution sees as affine
+      // recurrences of this loop.
+      SmallVector<std::pair<PHINode *, const SCEVAddRecExpr *>, 4> ivs;
+      for (PHINode &phi : header->phis()) {
+        if (!SE.isSCEVable(phi.getType()))
+          continue;
+        auto *rec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&phi));
+        if (!rec || rec->getLoop() != L || !rec->isAffine())
+          continue;
+        ivs.emplace_back(&phi, rec);
+        auto *step = dyn_cast<SCEVConstant>(rec->getOperand(1));
+        if (!step || step->getAPInt().getMinSignedBits() > 64)
+          continue;
+        int64_t stepValue = step->getAPInt().getSExtValue();
+        phi.setMetadata(ivKind, MDNode::get(ctx, {constant(i32, id),
+                                                  constant(i64, stepValue)}));
+        ++NumInductionVariables;
+      }
+
+      if (!sidecar)
+        continue;
+      sidecar->object([&] {
+        sidecar->attribute("id", (int64_t)id);
+        sidecar->attribute("function", F.getName());
+        sidecar->attribute("header", toString(*header));
+        sidecar->attribute("depth", (int64_t)L->getLoopDepth());
+        if (parent)
+          sidecar->attribute("parent", (int64_t)parentId);
+        else
+          sidecar->attribute("parent", nullptr);
+        sidecar->attributeArray("exiting", [&] {
+          for (BasicBlock *BB : exiting)
+            sidecar->value(toString(*BB));
+        });
+        sidecar->attributeObject("trip_count", [&] {
+          sidecar->attribute("kind", tripKind);
+          if (tripKind == "constant")
+            sidecar->attribute("value", (int64_t)trips);
+          if (tripKind == "symbolic") {
+            sidecar->attribute("backedge_taken", toString(*backedges));
+            if (trips)
+              sidecar->attribute("max", (int64_t)trips);
+          }
+        });
+        sidecar->attributeArray("induction_variables", [&] {
+          for (auto &iv : ivs)
+            sidecar->object([&] {
+              sidecar->attribute("phi", toString(*iv.first));
+              sidecar->attribute("start", toString(*iv.second->getStart()));
+              sidecar->attribute("step",
+                                 toString(*iv.second->getStepRecurrence(SE)));
+            });
+        });
+      });
+    }
+
+    for (auto &entry : exits)
+      entry.first->setMetadata(exitKind, MDNode::get(ctx, entry.second));
+  }
+
+  if (sidecar) {
+    sidecar->arrayEnd();
+    *file << '\n';
+  }
+  return nextId != 0;
+}
+
+PreservedAnalyses LoopMetadataPass::run(Module &M, ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  runOnModule(M, FAM);
+  // Only metadata was added.
+  return PreservedAnalyses::all();
+}
+} // namespace linker
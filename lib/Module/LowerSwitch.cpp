@@ -24,8 +24,6 @@ using namespace llvm;
 
 namespace linker {
 
-char LowerSwitchPass::ID = 0;
-
 // The comparison function for sorting the switch case values in the vector.
 struct SwitchCaseCmp {
   bool operator () (const LowerSwitchPass::SwitchCase& C1,
@@ -53,6 +51,11 @@ bool LowerSwitchPass::runOnFunction(Function &F) {
   return changed;
 }
 
+PreservedAnalyses LowerSwitchPass::run(Function &F, FunctionAnalysisManager &) {
+  return runOnFunction(F) ? PreservedAnalyses::none()
+                          : PreservedAnalyses::all();
+}
+
 // switchConvert - Convert the switch statement into a linear scan
 // through all the case values
 void LowerSwitchPass::switchConvert(CaseItr begin, CaseItr end,
@@ -0,0 +1,126 @@
+//===-- MergeFunctions.cpp ------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Replaces functions that are identical, up to pointer types, with a single
+// copy. uClibc and the POSIX runtime bring many of them along: wrappers,
+// _unlocked variants and helpers specialized for types of the same width.
+//
+// Unlike LLVM's MergeFunctions no thunks are created. A function is only
+// merged away if its address does not matter; non-local ones are kept as an
+// alias of the copy. Preserved functions and functions marked optnone, which
+// contain Engine calls, are never merged away.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/Transforms/Utils/FunctionComparator.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "fs-mergefunc"
+
+ALWAYS_ENABLED_STATISTIC(NumFunctionsMerged, "Number of functions merged");
+
+namespace {
+
+bool isCandidate(const Function &F) {
+  return !F.isDeclaration() && !F.isInterposable() && !F.hasOptNone() &&
+         !F.hasComdat() && !F.isIntrinsic();
+}
+
+// Returns true if F can be replaced with another function: nobody relies on
+// its address being distinct, and the Engine does not look it up by name.
+bool isReplaceable(const Function &F, const StringSet<> &preserved) {
+  if (preserved.count(F.getName()))
+    return false;
+  return F.hasGlobalUnnamedAddr() || !F.hasAddressTaken();
+}
+
+// Replaces Dup with Keep and erases it. A non-local Dup stays behind as an
+// alias, while its users call Keep directly.
+void replaceFunction(Function &Dup, Function &Keep) {
+  Constant *replacement = ConstantExpr::getBitCast(&Keep, Dup.getType());
+  Dup.replaceAllUsesWith(replacement);
+  if (!Dup.hasLocalLinkage()) {
+    GlobalAlias *alias =
+        GlobalAlias::create(Dup.getValueType(), Dup.getAddressSpace(),
+                            Dup.getLinkage(), "", replacement, Dup.getParent());
+    alias->setVisibility(Dup.getVisibility());
+    alias->takeName(&Dup);
+  }
+  Dup.eraseFromParent();
+}
+
+} // namespace
+
+namespace linker {
+
+MergeFunctionsPass::MergeFunctionsPass(
+    llvm::ArrayRef<const char *> preservedFunctions)
+    : preservedFunctions(preservedFunctions.begin(),
+                         preservedFunctions.end()) {}
+
+bool MergeFunctionsPass::runOnModule(Module &M) {
+  StringSet<> preserved;
+  for (const std::string &name : preservedFunctions)
+    preserved.insert(name);
+
+  // Equal functions have equal hashes, so only functions of the same bucket
+  // are compared. Buckets keep module order.
+  std::map<FunctionComparator::FunctionHash, std::vector<Function *>> buckets;
+  for (Function &F : M)
+    if (isCandidate(F))
+      buckets[FunctionComparator::functionHash(F)].push_back(&F);
+
+  GlobalNumberState globalNumbers;
+  std::vector<std::pair<Function *, Function *>> merges;
+  for (auto &bucket : buckets) {
+    std::vector<Function *> &functions = bucket.second;
+    // Prefer keeping the functions that cannot be replaced.
+    std::stable_partition(functions.begin(), functions.end(),
+                          [&](Function *F) {
+                            return !isReplaceable(*F, preserved);
+                          });
+    std::vector<Function *> kept;
+    for (Function *F : functions) {
+      Function *equal = nullptr;
+      if (isReplaceable(*F, preserved))
+        for (Function *K : kept)
+          if (FunctionComparator(K, F, &globalNumbers).compare() == 0) {
+            equal = K;
+            break;
+          }
+      if (equal)
+        merges.emplace_back(F, equal);
+      else
+        kept.push_back(F);
+    }
+  }
+
+  for (auto &merge : merges)
+    replaceFunction(*merge.first, *merge.second);
+  NumFunctionsMerged += merges.size();
+  return !merges.empty();
+}
+
+PreservedAnalyses MergeFunctionsPass::run(Module &M,
+                                          ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+} // namespace linker
@@ -0,0 +1,486 @@
+//===-- MergeStructTypes.cpp ----------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Linking modules that declare the same struct creates renamed copies of it
+// (%struct.FILE.123) whenever the bodies do not match exactly, which is the
+// case as soon as they refer to other renamed copies. This pass finds the
+// named struct types that are structurally identical, recursive types
+// included, and rewrites the module to use one type per class.
+//
+// Types cannot be changed in place, so the module is cloned with the types
+// remapped and the clone's contents are moved back into the module.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <map>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "merge-struct-types"
+
+ALWAYS_ENABLED_STATISTIC(NumMergedTypes,
+                         "Number of named struct types merged");
+ALWAYS_ENABLED_STATISTIC(NumRebuiltTypes,
+                         "Number of struct types rebuilt with merged elements");
+
+namespace {
+
+// Name a struct type had before the linker renamed it, %struct.FILE for
+// %struct.FILE.123.
+StringRef getBaseName(StringRef name) {
+  StringRef base, suffix;
+  std::tie(base, suffix) = name.rsplit('.');
+  unsigned number;
+  if (!base.empty() && !suffix.empty() && !suffix.getAsInteger(10, number))
+    return base;
+  return name;
+}
+
+// Partitions the named struct types into classes of structurally identical
+// types by refining a partition by name, shape and, until it is stable, the
+// classes of the element types.
+class TypeClasses {
+  DenseMap<StructType *, unsigned> classOf;
+  unsigned numClasses = 0;
+
+  void encode(raw_ostream &os, Type *type) const {
+    if (auto *st = dyn_cast<StructType>(type)) {
+      auto it = classOf.find(st);
+      if (it != classOf.end()) {
+        os << '%' << it->second;
+        return;
+      }
+      if (!st->isLiteral()) {
+        // Types left out of the partition only match themselves.
+        os << "%@" << (const void *)st;
+        return;
+      }
+      os << (st->isPacked() ? "<{" : "{");
+      for (Type *element : st->elements()) {
+        encode(os, element);
+        os << ',';
+      }
+      os << (st->isPacked() ? "}>" : "}");
+      return;
+    }
+    if (auto *pt = dyn_cast<PointerType>(type)) {
+      if (pt->isOpaque()) {
+        os << "ptr" << pt->getAddressSpace();
+        return;
+      }
+      encode(os, pt->getNonOpaquePointerElementType());
+      os << '*' << pt->getAddressSpace();
+      return;
+    }
+    if (auto *at = dyn_cast<ArrayType>(type)) {
+      os << '[' << at->getNumElements() << 'x';
+      encode(os, at->getElementType());
+      os << ']';
+      return;
+    }
+    if (auto *vt = dyn_cast<VectorType>(type)) {
+      os << '<' << vt->getElementCount().getKnownMinValue()
+         << (isa<ScalableVectorType>(vt) ? "vscale" : "") << 'x';
+      encode(os, vt->getElementType());
+      os << '>';
+      return;
+    }
+    if (auto *ft = dyn_cast<FunctionType>(type)) {
+      encode(os, ft->getReturnType());
+      os << '(';
+      for (Type *param : ft->params()) {
+        encode(os, param);
+        os << ',';
+      }
+      os << (ft->isVarArg() ? "...)" : ")");
+      return;
+    }
+    type->print(os);
+  }
+
+  std::string getShape(StructType *st) const {
+    std::string shape;
+    raw_string_ostream os(shape);
+    os << getBaseName(st->getName()) << ';';
+    if (st->isOpaque()) {
+      os << "opaque";
+    } else {
+      os << (st->isPacked() ? "packed;" : ";");
+      for (Type *element : st->elements()) {
+        encode(os, element);
+        os << ',';
+      }
+    }
+    return os.str();
+  }
+
+public:
+  std::vector<StructType *> types;
+
+  explicit TypeClasses(std::vector<StructType *> namedTypes)
+      : types(std::move(namedTypes)) {
+    // Every type starts in one class, so the first round splits by shape.
+    for (StructType *st : types)
+      classOf[st] = 0;
+    numClasses = types.empty() ? 0 : 1;
+
+    for (;;) {
+      std::map<std::pair<unsigned, std::string>, unsigned> keys;
+      DenseMap<StructType *, unsigned> refined;
+      for (StructType *st : types) {
+        auto key = std::make_pair(classOf[st], getShape(st));
+        auto it = keys.insert({key, keys.size()}).first;
+        refined[st] = it->second;
+      }
+      bool stable = keys.size() == numClasses;
+      classOf = std::move(refined);
+      numClasses = keys.size();
+      if (stable)
+        break;
+    }
+  }
+
+  unsigned getNumClasses() const { return numClasses; }
+  unsigned getClass(StructType *st) const { return classOf.lookup(st); }
+  bool contains(StructType *st) const { return classOf.count(st); }
+};
+
+// Collects the named struct types a type refers to, without looking into
+// their bodies.
+void collectNamedStructs(Type *type, SmallVectorImpl<StructType *> &result) {
+  if (auto *st = dyn_cast<StructType>(type)) {
+    if (!st->isLiteral()) {
+      result.push_back(st);
+      return;
+    }
+  }
+  if (auto *pt = dyn_cast<PointerType>(type)) {
+    if (!pt->isOpaque())
+      collectNamedStructs(pt->getNonOpaquePointerElementType(), result);
+    return;
+  }
+  for (Type *subtype : type->subtypes())
+    collectNamedStructs(subtype, result);
+}
+
+class StructTypeMapper : public ValueMapTypeRemapper {
+  DenseMap<Type *, Type *> mapped;
+
+public:
+  void map(Type *from, Type *to) { mapped[from] = to; }
+
+  Type *remapType(Type *type) override {
+    auto it = mapped.find(type);
+    if (it != mapped.end())
+      return it->second;
+
+    Type *result = type;
+    if (auto *pt = dyn_cast<PointerType>(type)) {
+      if (!pt->isOpaque())
+        result = PointerType::get(
+            remapType(pt->getNonOpaquePointerElementType()),
+            pt->getAddressSpace());
+    } else if (auto *at = dyn_cast<ArrayType>(type)) {
+      result = ArrayType::get(remapType(at->getElementType()),
+                              at->getNumElements());
+    } else if (auto *vt = dyn_cast<VectorType>(type)) {
+      result = VectorType::get(remapType(vt->getElementType()),
+                               vt->getElementCount());
+    } else if (auto *ft = dyn_cast<FunctionType>(type)) {
+      SmallVector<Type *, 8> params;
+      for (Type *param : ft->params())
+        params.push_back(remapType(param));
+      result = FunctionType::get(remapType(ft->getReturnType()), params,
+                                 ft->isVarArg());
+    } else if (auto *st = dyn_cast<StructType>(type)) {
+      if (st->isLiteral()) {
+        SmallVector<Type *, 8> elements;
+        for (Type *element : st->elements())
+          elements.push_back(remapType(element));
+        result = StructType::get(type->getContext(), elements,
+                                 st->isPacked());
+      }
+    }
+    mapped[type] = result;
+    return result;
+  }
+
+  AttributeList remapAttributes(LLVMContext &ctx, AttributeList attrs) {
+    for (unsigned index : attrs.indexes())
+      for (int kind = Attribute::FirstTypeAttr;
+           kind <= Attribute::LastTypeAttr; ++kind) {
+        auto attrKind = static_cast<Attribute::AttrKind>(kind);
+        if (Type *type =
+                attrs.getAttributeAtIndex(index, attrKind).getValueAsType())
+          attrs = attrs.replaceAttributeTypeAtIndex(ctx, index, attrKind,
+                                                    remapType(type));
+      }
+    return attrs;
+  }
+};
+
+// Clones M like llvm::CloneModule, remapping all types on the way.
+std::unique_ptr<Module>
+cloneWithTypes(Module &M, StructTypeMapper &mapper,
+               std::vector<std::pair<GlobalObject *, Comdat *>> &comdats) {
+  auto New = std::make_unique<Module>(M.getModuleIdentifier(), M.getContext());
+  New->setSourceFileName(M.getSourceFileName());
+  New->setDataLayout(M.getDataLayout());
+  New->setTargetTriple(M.getTargetTriple());
+  New->setModuleInlineAsm(M.getModuleInlineAsm());
+
+  ValueToValueMapTy VMap;
+  for (GlobalVariable &G : M.globals()) {
+    auto *NewGV = new GlobalVariable(
+        *New, mapper.remapType(G.getValueType()), G.isConstant(),
+        G.getLinkage(), nullptr, G.getName(), nullptr, G.getThreadLocalMode(),
+        G.getType()->getAddressSpace());
+    NewGV->copyAttributesFrom(&G);
+    VMap[&G] = NewGV;
+  }
+  for (Function &F : M) {
+    Function *NewF = Function::Create(
+        cast<FunctionType>(mapper.remapType(F.getFunctionType())),
+        F.getLinkage(), F.getAddressSpace(), F.getName(), New.get());
+    NewF->copyAttributesFrom(&F);
+    VMap[&F] = NewF;
+  }
+  for (GlobalAlias &A : M.aliases()) {
+    auto *NewA = GlobalAlias::create(mapper.remapType(A.getValueType()),
+                                     A.getType()->getPointerAddressSpace(),
+                                     A.getLinkage(), A.getName(), New.get());
+    NewA->copyAttributesFrom(&A);
+    VMap[&A] = NewA;
+  }
+  for (GlobalIFunc &I : M.ifuncs()) {
+    auto *NewI = GlobalIFunc::create(mapper.remapType(I.getValueType()),
+                                     I.getAddressSpace(), I.getLinkage(),
+                                     I.getName(), nullptr, New.get());
+    NewI->copyAttributesFrom(&I);
+    VMap[&I] = NewI;
+  }
+
+  for (GlobalVariable &G : M.globals()) {
+    auto *NewGV = cast<GlobalVariable>(VMap[&G]);
+    SmallVector<std::pair<unsigned, MDNode *>, 1> MDs;
+    G.getAllMetadata(MDs);
+    for (auto &MD : MDs)
+      NewGV->addMetadata(MD.first, *MapMetadata(MD.second, VMap, RF_None,
+                                                &mapper));
+    if (G.hasInitializer())
+      NewGV->setInitializer(
+          MapValue(G.getInitializer(), VMap, RF_None, &mapper));
+    if (Comdat *C = G.getComdat())
+      comdats.emplace_back(NewGV, C);
+  }
+
+  for (Function &F : M) {
+    auto *NewF = cast<Function>(VMap[&F]);
+    if (F.isDeclaration()) {
+      SmallVector<std::pair<unsigned, MDNode *>, 1> MDs;
+      F.getAllMetadata(MDs);
+      for (auto &MD : MDs)
+        NewF->addMetadata(MD.first, *MapMetadata(MD.second, VMap, RF_None,
+                                                 &mapper));
+    } else {
+      auto DestI = NewF->arg_begin();
+      for (Argument &A : F.args()) {
+        DestI->setName(A.getName());
+        VMap[&A] = &*DestI++;
+      }
+      SmallVector<ReturnInst *, 8> Returns;
+      CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::ClonedModule,
+                        Returns, "", nullptr, &mapper);
+      if (F.hasPersonalityFn())
+        NewF->setPersonalityFn(
+            MapValue(F.getPersonalityFn(), VMap, RF_None, &mapper));
+      if (Comdat *C = F.getComdat())
+        comdats.emplace_back(NewF, C);
+    }
+    NewF->setAttributes(
+        mapper.remapAttributes(M.getContext(), NewF->getAttributes()));
+  }
+
+  for (GlobalAlias &A : M.aliases())
+    if (const Constant *C = A.getAliasee())
+      cast<GlobalAlias>(VMap[&A])->setAliasee(
+          MapValue(C, VMap, RF_None, &mapper));
+  for (GlobalIFunc &I : M.ifuncs())
+    if (const Constant *C = I.getResolver())
+      cast<GlobalIFunc>(VMap[&I])->setResolver(
+          MapValue(C, VMap, RF_None, &mapper));
+
+  for (NamedMDNode &NMD : M.named_metadata()) {
+    NamedMDNode *NewNMD = New->getOrInsertNamedMetadata(NMD.getName());
+    for (MDNode *op : NMD.operands())
+      NewNMD->addOperand(MapMetadata(op, VMap, RF_None, &mapper));
+  }
+
+  // Type attributes on call sites refer to the old types as well.
+  for (Function &F : *New)
+    for (Instruction &I : instructions(F))
+      if (auto *CB = dyn_cast<CallBase>(&I))
+        CB->setAttributes(
+            mapper.remapAttributes(M.getContext(), CB->getAttributes()));
+  return New;
+}
+
+// Replaces the contents of M by those of New.
+void replaceContents(Module &M, Module &New,
+                     std::vector<std::pair<GlobalObject *, Comdat *>> &comdats) {
+  for (Function &F : M)
+    F.dropAllReferences();
+  for (GlobalVariable &G : M.globals())
+    G.dropAllReferences();
+  for (GlobalAlias &A : M.aliases())
+    A.dropAllReferences();
+  for (GlobalIFunc &I : M.ifuncs())
+    I.dropAllReferences();
+  for (GlobalValue &GV : M.global_values())
+    GV.removeDeadConstantUsers();
+  while (!M.global_empty())
+    M.global_begin()->eraseFromParent();
+  while (!M.empty())
+    M.begin()->eraseFromParent();
+  while (!M.alias_empty())
+    M.alias_begin()->eraseFromParent();
+  while (!M.ifunc_empty())
+    M.ifunc_begin()->eraseFromParent();
+  while (!M.named_metadata_empty())
+    M.eraseNamedMetadata(&*M.named_metadata_begin());
+
+  M.getGlobalList().splice(M.global_end(), New.getGlobalList());
+  M.getFunctionList().splice(M.end(), New.getFunctionList());
+  M.getAliasList().splice(M.alias_end(), New.getAliasList());
+  M.getIFuncList().splice(M.ifunc_end(), New.getIFuncList());
+  for (NamedMDNode &NMD : New.named_metadata()) {
+    NamedMDNode *MovedNMD = M.getOrInsertNamedMetadata(NMD.getName());
+    for (MDNode *op : NMD.operands())
+      MovedNMD->addOperand(op);
+  }
+
+  // Comdats belong to the module and outlive the globals that used them.
+  for (auto &entry : comdats)
+    entry.first->setComdat(entry.second);
+
+  // Overloaded intrinsics carry the names of their types.
+  for (auto it = M.begin(), ie = M.end(); it != ie;) {
+    Function &F = *it++;
+    if (auto remangled = Intrinsic::remangleIntrinsicFunction(&F)) {
+      F.replaceAllUsesWith(*remangled);
+      F.eraseFromParent();
+    }
+  }
+}
+} // namespace
+
+namespace linker {
+
+bool MergeStructTypesPass::runOnModule(Module &M) {
+  TypeFinder finder;
+  finder.run(M, /*onlyNamed=*/true);
+  std::vector<StructType *> named(finder.begin(), finder.end());
+
+  // Only the copies the linker renamed can be merged, so unless two types
+  // share a base name there is nothing to compare, let alone clone.
+  StringSet<> baseNames;
+  if (llvm::all_of(named, [&](StructType *st) {
+        return baseNames.insert(getBaseName(st->getName())).second;
+      }))
+    return false;
+
+  TypeClasses classes(std::move(named));
+  if (classes.getNumClasses() == classes.types.size())
+    return false;
+
+  // The representative of a class is the member with the shortest name,
+  // which is the original one if it is still around.
+  std::vector<StructType *> representative(classes.getNumClasses(), nullptr);
+  std::vector<unsigned> size(classes.getNumClasses(), 0);
+  for (StructType *st : classes.types) {
+    unsigned c = classes.getClass(st);
+    ++size[c];
+    StructType *&rep = representative[c];
+    if (!rep || st->getName().size() < rep->getName().size())
+      rep = st;
+  }
+
+  // A representative whose body refers to a type that is merged, directly
+  // or through another such representative, has to be recreated.
+  std::vector<bool> rebuild(classes.getNumClasses(), false);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (unsigned c = 0; c < rebuild.size(); ++c) {
+      if (rebuild[c])
+        continue;
+      SmallVector<StructType *, 8> referenced;
+      for (Type *element : representative[c]->elements())
+        collectNamedStructs(element, referenced);
+      for (StructType *st : referenced) {
+        if (!classes.contains(st))
+          continue;
+        unsigned d = classes.getClass(st);
+        if (representative[d] != st || rebuild[d]) {
+          rebuild[c] = changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  StructTypeMapper mapper;
+  std::vector<StructType *> target(representative);
+  for (unsigned c = 0; c < target.size(); ++c) {
+    if (!rebuild[c])
+      continue;
+    std::string name = representative[c]->getName().str();
+    representative[c]->setName("");
+    target[c] = StructType::create(M.getContext(), name);
+    ++NumRebuiltTypes;
+  }
+  for (StructType *st : classes.types)
+    mapper.map(st, target[classes.getClass(st)]);
+  for (unsigned c = 0; c < target.size(); ++c) {
+    if (!rebuild[c] || representative[c]->isOpaque())
+      continue;
+    SmallVector<Type *, 8> elements;
+    for (Type *element : representative[c]->elements())
+      elements.push_back(mapper.remapType(element));
+    target[c]->setBody(elements, representative[c]->isPacked());
+  }
+  for (unsigned c = 0; c < size.size(); ++c)
+    NumMergedTypes += size[c] - 1;
+
+  std::vector<std::pair<GlobalObject *, Comdat *>> comdats;
+  std::unique_ptr<Module> New = cloneWithTypes(M, mapper, comdats);
+  replaceContents(M, *New, comdats);
+  return true;
+}
+
+PreservedAnalyses MergeStructTypesPass::run(Module &M,
+                                            ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+} // namespace linker
@@ -15,6 +15,7 @@
 #include "llvm/BinaryFormat/Magic.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Function.h"
@@ -359,6 +360,22 @@ bool linker::functionEscapes(const Function *f) {
   return !valueIsOnlyCalled(f);
 }
 
+std::vector<ConstantStruct *>
+linker::getCtorListByPriority(const GlobalVariable *list) {
+  std::vector<ConstantStruct *> entries;
+  // An empty list may be a zeroinitializer instead of an array.
+  if (auto *arr = dyn_cast<ConstantArray>(list->getInitializer()))
+    for (const Use &op : arr->operands())
+      entries.push_back(cast<ConstantStruct>(op));
+
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const ConstantStruct *a, const ConstantStruct *b) {
+                     return cast<ConstantInt>(a->getOperand(0))->getZExtValue() <
+                            cast<ConstantInt>(b->getOperand(0))->getZExtValue();
+                   });
+  return entries;
+}
+
 bool linker::loadFile(const std::string &fileName, LLVMContext &context,
                     std::vector<std::unique_ptr<llvm::Module>> &modules,
                     std::string &errorMsg) {
@@ -0,0 +1,230 @@
+//===-- NarrowIntWidth.cpp ------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Narrows integer arithmetic and comparisons to the smallest width that gives
+// the same result. C promotes characters and shorts to int before operating
+// on them, so the Engine would otherwise hand the solver 32 or 64 bit terms
+// over values that only ever have 8 bits.
+//
+//  - An add, sub, mul, and, or, xor or shl of which only the low N bits are
+//    used (DemandedBits) is done in N bits and zero extended.
+//  - An icmp whose operands are known to fit in N bits (LazyValueInfo) is
+//    done in N bits, if the predicate is unchanged by that.
+//
+// An instruction is only narrowed if its operands already are available in N
+// bits: constants, extensions from N bits, or instructions narrowed before.
+// Narrowing anything else would add a truncation per operand to the terms
+// instead of removing an extension.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/DemandedBits.h"
+#include "llvm/Analysis/LazyValueInfo.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "narrow-int-width"
+
+ALWAYS_ENABLED_STATISTIC(NumNarrowedOps,
+                         "Number of arithmetic instructions narrowed");
+ALWAYS_ENABLED_STATISTIC(NumNarrowedCmps, "Number of comparisons narrowed");
+ALWAYS_ENABLED_STATISTIC(NumBitsSaved,
+                         "Number of result bits removed from narrowed "
+                         "instructions");
+
+namespace {
+
+const unsigned NarrowWidths[] = {8, 16, 32};
+
+bool isNarrowableOp(const Instruction &I) {
+  switch (I.getOpcode()) {
+  case Instruction::Add:
+  case Instruction::Sub:
+  case Instruction::Mul:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+    return true;
+  case Instruction::Shl: {
+    // The shift amount has to stay in range in the narrow type.
+    auto *amount = dyn_cast<ConstantInt>(I.getOperand(1));
+    return amount && amount->getValue().ult(8);
+  }
+  default:
+    return false;
+  }
+}
+
+class Narrower {
+  Function &F;
+  DemandedBits &DB;
+  LazyValueInfo &LVI;
+
+  // Instructions that may have become dead.
+  SmallVector<WeakTrackingVH, 16> maybeDead;
+
+  // Returns V in width bits if that takes no new instruction, or null.
+  // Narrowed instructions are zero extended, so they are found as well.
+  Value *getAvailable(Value *V, unsigned width) {
+    Type *type = IntegerType::get(F.getContext(), width);
+    if (auto *C = dyn_cast<ConstantInt>(V))
+      return ConstantInt::get(type, C->getValue().trunc(width));
+    if (auto *ext = dyn_cast<CastInst>(V))
+      if ((isa<ZExtInst>(ext) || isa<SExtInst>(ext)) &&
+          ext->getSrcTy() == type)
+        return ext->getOperand(0);
+    return nullptr;
+  }
+
+  // Returns the smallest width below that of the result in which the
+  // low demanded bits of I can be computed, or 0.
+  unsigned getDemandedWidth(Instruction &I) {
+    unsigned width = I.getType()->getIntegerBitWidth();
+    unsigned demanded = DB.getDemandedBits(&I).getActiveBits();
+    for (unsigned narrow : NarrowWidths)
+      if (narrow < width && demanded <= narrow)
+        return narrow;
+    return 0;
+  }
+
+  bool narrowOp(Instruction &I, unsigned width);
+  bool narrowCmp(ICmpInst &I);
+
+public:
+  Narrower(Function &F, DemandedBits &DB, LazyValueInfo &LVI)
+      : F(F), DB(DB), LVI(LVI) {}
+
+  bool run();
+};
+
+bool Narrower::narrowOp(Instruction &I, unsigned width) {
+  Value *lhs = getAvailable(I.getOperand(0), width);
+  Value *rhs = getAvailable(I.getOperand(1), width);
+  if (!lhs || !rhs || (isa<Constant>(lhs) && isa<Constant>(rhs)))
+    return false;
+
+  // The wrap flags do not carry over to the narrow type.
+  IRBuilder<> Builder(&I);
+  Value *op = Builder.CreateBinOp(cast<BinaryOperator>(I).getOpcode(), lhs,
+                                  rhs, I.getName() + ".narrow");
+  Value *ext = Builder.CreateZExt(op, I.getType());
+  ext->takeName(&I);
+  I.replaceAllUsesWith(ext);
+  // Truncations back to the narrow type are the narrow result itself.
+  for (User *U : ext->users())
+    if (auto *trunc = dyn_cast<TruncInst>(U))
+      if (trunc->getDestTy() == op->getType()) {
+        trunc->replaceAllUsesWith(op);
+        maybeDead.push_back(trunc);
+      }
+
+  ++NumNarrowedOps;
+  NumBitsSaved += I.getType()->getIntegerBitWidth() - width;
+  return true;
+}
+
+bool Narrower::narrowCmp(ICmpInst &I) {
+  unsigned bits = I.getOperand(0)->getType()->getIntegerBitWidth();
+  ConstantRange lhsRange = LVI.getConstantRange(I.getOperand(0), &I, false);
+  ConstantRange rhsRange = LVI.getConstantRange(I.getOperand(1), &I, false);
+  ConstantRange range = lhsRange.unionWith(rhsRange);
+
+  for (unsigned width : NarrowWidths) {
+    if (width >= bits)
+      break;
+    // Truncation keeps the values iff they fit in width bits, unsigned or
+    // signed. The predicates keep their meaning on the truncated values if
+    // they agree with the way the values fit.
+    bool fitsUnsigned = range.getUnsignedMax().getActiveBits() <= width;
+    bool fitsSigned = range.getSignedMin().getMinSignedBits() <= width &&
+                      range.getSignedMax().getMinSignedBits() <= width;
+    ICmpInst::Predicate pred = I.getPredicate();
+    if (!(fitsUnsigned && fitsSigned) &&
+        !(fitsUnsigned && !I.isSigned()) && !(fitsSigned && !I.isUnsigned()))
+      continue;
+
+    Value *lhs = getAvailable(I.getOperand(0), width);
+    Value *rhs = getAvailable(I.getOperand(1), width);
+    if (!lhs || !rhs || (isa<Constant>(lhs) && isa<Constant>(rhs)))
+      continue;
+
+    IRBuilder<> Builder(&I);
+    Value *cmp = Builder.CreateICmp(pred, lhs, rhs);
+    cmp->takeName(&I);
+    I.replaceAllUsesWith(cmp);
+
+    ++NumNarrowedCmps;
+    NumBitsSaved += bits - width;
+    return true;
+  }
+  return false;
+}
+
+bool Narrower::run() {
+  // Decide on the widths before anything changes, the demanded bits are not
+  // kept up to date.
+  DenseMap<Instruction *, unsigned> widths;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      if (I.getType()->isIntegerTy() && isNarrowableOp(I))
+        if (unsigned width = getDemandedWidth(I))
+          widths[&I] = width;
+
+  // Definitions before uses, so that chains are narrowed as a whole.
+  std::vector<Instruction *> dead;
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT)
+    for (Instruction &I : *BB) {
+      bool changed = false;
+      auto width = widths.find(&I);
+      if (width != widths.end())
+        changed = narrowOp(I, width->second);
+      else if (auto *cmp = dyn_cast<ICmpInst>(&I))
+        changed = cmp->getOperand(0)->getType()->isIntegerTy() &&
+                  narrowCmp(*cmp);
+      if (changed)
+        dead.push_back(&I);
+    }
+
+  // Drop the replaced instructions and what only they used.
+  for (Instruction *I : dead) {
+    maybeDead.append(I->op_begin(), I->op_end());
+    I->eraseFromParent();
+  }
+  RecursivelyDeleteTriviallyDeadInstructionsPermissive(maybeDead);
+  return !dead.empty();
+}
+
+} // namespace
+
+namespace linker {
+
+bool NarrowIntWidthPass::runOnFunction(Function &F, DemandedBits &DB,
+                                       LazyValueInfo &LVI) {
+  return Narrower(F, DB, LVI).run();
+}
+
+PreservedAnalyses NarrowIntWidthPass::run(Function &F,
+                                          FunctionAnalysisManager &FAM) {
+  if (!runOnFunction(F, FAM.getResult<DemandedBitsAnalysis>(F),
+                     FAM.getResult<LazyValueAnalysis>(F)))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+} // namespace linker
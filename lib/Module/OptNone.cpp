@@ -14,19 +14,115 @@
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+
+#include <utility>
+#include <vector>
 
 namespace linker {
 
-char OptNonePass::ID;
+// todo: modify this if we change external prefix
+bool isEngineFunction(const llvm::Function &F) {
+  return F.hasName() &&
+         (F.getName().startswith("klee_") || F.getName().startswith("gs_") ||
+          F.getName().startswith("make_symbolic"));
+}
+} // namespace linker
+
+using linker::isEngineFunction;
+
+namespace {
+
+bool isEngineCall(const llvm::Instruction &I) {
+  auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+  if (!CI)
+    return false;
+  auto *callee = CI->getCalledFunction();
+  return callee && isEngineFunction(*callee);
+}
+
+// Returns the first and last instruction of every run of adjacent Engine calls
+// in F, ignoring debug intrinsics in between.
+std::vector<std::pair<llvm::Instruction *, llvm::Instruction *>>
+collectEngineRegions(llvm::Function &F) {
+  std::vector<std::pair<llvm::Instruction *, llvm::Instruction *>> regions;
+  for (auto &BB : F) {
+    llvm::Instruction *first = nullptr, *last = nullptr;
+    for (auto &I : BB) {
+      if (isEngineCall(I)) {
+        if (!first)
+          first = &I;
+        last = &I;
+      } else if (first && !llvm::isa<llvm::DbgInfoIntrinsic>(I)) {
+        regions.emplace_back(first, last);
+        first = last = nullptr;
+      }
+    }
+  }
+  return regions;
+}
+
+llvm::CodeExtractor createExtractor(llvm::BasicBlock *BB) {
+  return llvm::CodeExtractor({BB}, /*DT=*/nullptr,
+                             /*AggregateArgs=*/false, /*BFI=*/nullptr,
+                             /*BPI=*/nullptr, /*AC=*/nullptr,
+                             /*AllowVarArgs=*/false,
+                             /*AllowAlloca=*/false, "fs.optnone");
+}
+
+// Moves every run of Engine calls in F into its own function. Returns false if
+// a region cannot be extracted, in which case F is left as it was and the
+// caller is left to mark it as a whole.
+bool outlineEngineRegions(llvm::Function &F) {
+  std::vector<llvm::BasicBlock *> blocks;
+  for (auto &region : collectEngineRegions(F)) {
+    llvm::BasicBlock *BB = llvm::SplitBlock(region.first->getParent(),
+                                            region.first);
+    llvm::SplitBlock(BB, region.second->getNextNode());
+    blocks.push_back(BB);
+  }
+
+  // Outline either all regions or none of them.
+  for (llvm::BasicBlock *BB : blocks) {
+    if (createExtractor(BB).isEligible())
+      continue;
+    for (auto it = blocks.rbegin(), ie = blocks.rend(); it != ie; ++it) {
+      llvm::BasicBlock *head = (*it)->getSinglePredecessor();
+      bool named = head->hasName();
+      llvm::MergeBlockIntoPredecessor((*it)->getSingleSuccessor());
+      llvm::MergeBlockIntoPredecessor(*it);
+      // An unnamed block takes the name of the block merged into it.
+      if (!named)
+        head->setName("");
+    }
+    return false;
+  }
+
+  for (llvm::BasicBlock *BB : blocks) {
+    llvm::CodeExtractorAnalysisCache CEAC(F);
+    llvm::Function *outlined = createExtractor(BB).extractCodeRegion(CEAC);
+    assert(outlined && "eligible region was not extracted");
+    outlined->removeFnAttr(llvm::Attribute::InlineHint);
+    outlined->addFnAttr(llvm::Attribute::OptimizeNone);
+    outlined->addFnAttr(llvm::Attribute::NoInline);
+  }
+  return true;
+}
+} // namespace
+
+namespace linker {
 
 bool OptNonePass::runOnModule(llvm::Module &M) {
-  // todo: modify this if we change external prefix
   // Find list of functions that start with `klee_` or `gs_` or `make_symbolic`
   // and mark all functions that contain such call or invoke as optnone
   llvm::SmallPtrSet<llvm::Function *,16> CallingFunctions;
+  llvm::SmallPtrSet<llvm::Function *,16> InvokingFunctions;
   for (auto &F : M) {
-    if (!F.hasName() || !(F.getName().startswith("klee_") || F.getName().startswith("gs_") || F.getName().startswith("make_symbolic")))
+    if (!isEngineFunction(F))
       continue;
     for (auto *U : F.users()) {
       // skip non-calls and non-invokes
@@ -34,14 +130,27 @@ bool OptNonePass::runOnModule(llvm::Module &M) {
         continue;
       auto *Inst = llvm::cast<llvm::Instruction>(U);
       CallingFunctions.insert(Inst->getParent()->getParent());
+      if (llvm::isa<llvm::InvokeInst>(Inst))
+        InvokingFunctions.insert(Inst->getParent()->getParent());
     }
   }
 
   bool changed = false;
+  cfgChanged = false;
   for (auto F : CallingFunctions) {
     // Skip if already annotated
     if (F->hasFnAttribute(llvm::Attribute::OptimizeNone))
       continue;
+    // Invokes terminate their block and cannot be moved out on their own, and
+    // the Engine's own helpers are kept as they are.
+    if ((outlineRegions || F->hasFnAttribute(llvm::Attribute::Hot)) &&
+        !isEngineFunction(*F) &&
+        !InvokingFunctions.count(F)) {
+      if (outlineEngineRegions(*F)) {
+        changed = cfgChanged = true;
+        continue;
+      }
+    }
     F->addFnAttr(llvm::Attribute::OptimizeNone);
     F->addFnAttr(llvm::Attribute::NoInline);
     changed = true;
@@ -49,4 +158,13 @@ bool OptNonePass::runOnModule(llvm::Module &M) {
 
   return changed;
 }
+
+llvm::PreservedAnalyses OptNonePass::run(llvm::Module &M,
+                                         llvm::ModuleAnalysisManager &) {
+  // Only function attributes change, which no analysis depends on, unless
+  // regions are outlined.
+  if (!runOnModule(M) || !cfgChanged)
+    return llvm::PreservedAnalyses::all();
+  return llvm::PreservedAnalyses::none();
+}
 } // namespace linker
@@ -15,30 +15,33 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "Passes.h"
+
 #include "fs-linker/Config/Version.h"
 #include "fs-linker/Support/Utils.h"
 
 
-#include "llvm/Analysis/GlobalsModRef.h"
-#include "llvm/Analysis/Passes.h"
-#include "llvm/Analysis/LoopPass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IR/DataLayout.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/CommandLine.h"
-#include "llvm/Support/DynamicLibrary.h"
-#include "llvm/Support/PluginLoader.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/IPO.h"
-#include "llvm/Transforms/IPO/FunctionAttrs.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-
-#if LLVM_VERSION_CODE >= LLVM_VERSION(7, 0)
-#include "llvm/Transforms/Utils.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#endif
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/StripSymbols.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
@@ -52,12 +55,6 @@ static cl::opt<bool> DisableInternalize(
     cl::desc("Do not mark all symbols as internal (default=false)"),
     cl::init(false), cl::cat(linker::ModuleCat));
 
-static cl::opt<bool> VerifyEach(
-    "verify-each",
-    cl::desc("Verify intermediate results of all optimization passes (default=false)"),
-    cl::init(false),
-    cl::cat(linker::ModuleCat));
-
 static cl::alias ExportDynamic("export-dynamic",
                                cl::aliasopt(DisableInternalize),
                                cl::desc("Alias for -disable-internalize"));
@@ -77,185 +74,561 @@ static cl::opt<bool>
 static cl::alias A1("S", cl::desc("Alias for --strip-debug"),
                     cl::aliasopt(StripDebug));
 
-// A utility function that adds a pass to the pass manager but will also add
-// a verifier pass after if we're supposed to verify.
-static inline void addPass(legacy::PassManager &PM, Pass *P) {
-  // Add the pass to the pass manager...
-  PM.add(P);
-
-  // If we are verifying all of the intermediate steps, add the verifier...
-  if (VerifyEach)
-    PM.add(createVerifierPass());
+namespace {
+struct OptProfile {
+  const char *name;
+  const char *pipeline;
+  // The profile split for --opt-threads: ipo runs over the whole module,
+  // then the function passes run over partitions of it in parallel.
+  const char *ipo;
+  const char *function;
+};
+
+// The opt standard pass list followed by the link time optimizations. This
+// is what --optimize has always run. fs-inline and fs-internalize honour
+// --disable-inlining and --disable-internalize.
+const char *const defaultPipeline =
+    // Standard compile passes
+    "function(simplifycfg,mem2reg),globalopt,globaldce,"
+    "function(sccp),deadargelim,function(instcombine,simplifycfg),"
+    "cgscc(function-attrs),rpo-function-attrs,"
+    "cgscc(fs-inline,argpromotion,function("
+    "instcombine,jump-threading,simplifycfg,sroa,instcombine,tailcallelim,"
+    "simplifycfg,reassociate,"
+    "loop-mssa(loop-rotate,licm,simple-loop-unswitch),instcombine,"
+    "loop(indvars,loop-deletion),loop-unroll,instcombine,gvn,memcpyopt,sccp,"
+    "instcombine,dse,adce,simplifycfg)),"
+    "strip-dead-prototypes,constmerge,"
+    // Link time optimizations
+    "fs-internalize,ipsccp,globalopt,constmerge,deadargelim,"
+    "function(instcombine),cgscc(fs-inline),globalopt,globaldce,"
+    "cgscc(argpromotion,function(instcombine,jump-threading,sroa)),"
+    "cgscc(function-attrs),rpo-function-attrs,require<globals-aa>,"
+    "function(loop-mssa(licm),gvn,memcpyopt,dse,instcombine,jump-threading,"
+    "mem2reg,simplifycfg),"
+    "globaldce,function(instcombine,simplifycfg,adce),globaldce";
+
+// The interprocedural part of the default pipeline. It keeps the cheap
+// function passes that shape inlining decisions.
+const char *const defaultIPO =
+    "function(simplifycfg,mem2reg),globalopt,globaldce,"
+    "function(sccp),deadargelim,function(instcombine,simplifycfg),"
+    "cgscc(function-attrs),rpo-function-attrs,"
+    "cgscc(fs-inline,argpromotion,function(instcombine,simplifycfg,sroa)),"
+    "strip-dead-prototypes,constmerge,"
+    "fs-internalize,ipsccp,globalopt,constmerge,deadargelim,"
+    "function(instcombine),cgscc(fs-inline),globalopt,globaldce,"
+    "cgscc(argpromotion,function(instcombine,jump-threading,sroa)),"
+    "cgscc(function-attrs),rpo-function-attrs,globaldce";
+
+const char *const defaultFunction =
+    "instcombine,jump-threading,simplifycfg,sroa,instcombine,tailcallelim,"
+    "simplifycfg,reassociate,"
+    "loop-mssa(loop-rotate,licm,simple-loop-unswitch),instcombine,"
+    "loop(indvars,loop-deletion),loop-unroll,instcombine,gvn,memcpyopt,sccp,"
+    "instcombine,dse,adce,simplifycfg,"
+    "loop-mssa(licm),gvn,memcpyopt,dse,instcombine,jump-threading,"
+    "mem2reg,simplifycfg,instcombine,simplifycfg,adce";
+
+const OptProfile optProfiles[] = {
+  // A single round of inexpensive scalar and interprocedural cleanups. No
+  // loop passes, no GVN and no jump threading.
+  { "fast",
+    "function(simplifycfg,mem2reg),globalopt,globaldce,deadargelim,"
+    "function(instcombine,simplifycfg),cgscc(function-attrs),fs-internalize,"
+    "ipsccp,globalopt,cgscc(fs-inline,function(sroa,instcombine,simplifycfg,"
+    "adce)),strip-dead-prototypes,constmerge,globaldce",
+    "function(simplifycfg,mem2reg),globalopt,globaldce,deadargelim,"
+    "function(instcombine,simplifycfg),cgscc(function-attrs),fs-internalize,"
+    "ipsccp,globalopt,cgscc(fs-inline,function(sroa)),strip-dead-prototypes,"
+    "constmerge,globaldce",
+    "sroa,instcombine,simplifycfg,adce" },
+  { "default", defaultPipeline, defaultIPO, defaultFunction },
+  // The default pipeline followed by another round of scalar and loop
+  // optimizations over the code exposed by the second inlining round.
+  { "aggressive",
+    "@default,function(sroa,instcombine,simplifycfg,reassociate,"
+    "loop-mssa(loop-rotate,licm,simple-loop-unswitch),instcombine,"
+    "loop(indvars,loop-deletion),loop-unroll,instcombine,gvn,memcpyopt,sccp,"
+    "instcombine,dse,adce,simplifycfg),globaldce",
+    defaultIPO,
+    "instcombine,jump-threading,simplifycfg,sroa,instcombine,tailcallelim,"
+    "simplifycfg,reassociate,"
+    "loop-mssa(loop-rotate,licm,simple-loop-unswitch),instcombine,"
+    "loop(indvars,loop-deletion),loop-unroll,instcombine,gvn,memcpyopt,sccp,"
+    "instcombine,dse,adce,simplifycfg,"
+    "loop-mssa(licm),gvn,memcpyopt,dse,instcombine,jump-threading,"
+    "mem2reg,simplifycfg,instcombine,simplifycfg,adce,"
+    "sroa,instcombine,simplifycfg,reassociate,"
+    "loop-mssa(loop-rotate,licm,simple-loop-unswitch),instcombine,"
+    "loop(indvars,loop-deletion),loop-unroll,instcombine,gvn,memcpyopt,sccp,"
+    "instcombine,dse,adce,simplifycfg" },
+  // For code that is executed symbolically rather than natively. InstCombine
+  // is left out because it replaces arithmetic and branches with bit tricks
+  // and selects that are cheap on hardware but make solver queries harder.
+  // fs-simplifycfg does not speculate or build lookup tables, and
+  // fs-solver-canon turns magic-number divisions back into udiv/urem.
+  { "symbolic",
+    "function(fs-simplifycfg,sroa,early-cse,instsimplify),globalopt,"
+    "globaldce,ipsccp,deadargelim,cgscc(function-attrs),rpo-function-attrs,"
+    "fs-internalize,ipsccp,globalopt,cgscc(fs-inline,function(sroa,"
+    "early-cse,instsimplify,sccp,fs-simplifycfg,dse,adce)),globalopt,"
+    "globaldce,strip-dead-prototypes,constmerge,"
+    "function(fs-solver-canon,instsimplify,adce),globaldce",
+    "function(fs-simplifycfg,sroa,early-cse,instsimplify),globalopt,"
+    "globaldce,ipsccp,deadargelim,cgscc(function-attrs),rpo-function-attrs,"
+    "fs-internalize,ipsccp,globalopt,cgscc(fs-inline,function(sroa,"
+    "early-cse)),globalopt,globaldce,strip-dead-prototypes,constmerge",
+    "instsimplify,sccp,fs-simplifycfg,dse,adce,fs-solver-canon,instsimplify,"
+    "adce" },
+};
+
+// What --cleanup runs instead of --optimize. It removes unused and
+// duplicate globals and promotes allocas, but keeps the functions and their
+// branches as they are, apart from the single small blocks that SimplifyCFG
+// in LLVM 14 speculates whatever its options say.
+const char *const cleanupPipeline =
+    "fs-constify-globals,function(mem2reg,fs-simplifycfg),globaldce,"
+    "constmerge";
+
+// What --loop-idiom runs, with or without --optimize. Loop idiom recognition
+// needs the induction variables in registers and the loops rotated, so that
+// the body runs on every iteration; the loops it empties are deleted, and
+// the branches left behind are kept as they are.
+const char *const loopIdiomPipeline =
+    "mem2reg,loop(loop-rotate,loop-idiom,loop-deletion),fs-simplifycfg";
+
+const OptProfile *findProfile(StringRef Name) {
+  for (const OptProfile &P : optProfiles)
+    if (Name == P.name)
+      return &P;
+  return nullptr;
 }
+} // namespace
+
+static cl::opt<std::string> OptPipeline(
+    "opt-pipeline",
+    cl::desc("Passes run by --optimize: either a profile (fast, default, "
+             "aggressive, symbolic) or a pipeline in the syntax of opt "
+             "-passes, in which @profile stands for the passes of a profile "
+             "(default=default)"),
+    cl::value_desc("profile|pipeline"), cl::init("default"),
+    cl::cat(linker::ModuleCat));
 
-namespace llvm {
-
-
-static void AddStandardCompilePasses(legacy::PassManager &PM) {
-  PM.add(createVerifierPass());                  // Verify that input is correct
-
-  // If the -strip-debug command line option was specified, do it.
-  if (StripDebug)
-    addPass(PM, createStripSymbolsPass(true));
-
-  addPass(PM, createCFGSimplificationPass());    // Clean up disgusting code
-  addPass(PM, createPromoteMemoryToRegisterPass());// Kill useless allocas
-  addPass(PM, createGlobalOptimizerPass());      // Optimize out global vars
-  addPass(PM, createGlobalDCEPass());            // Remove unused fns and globs
-#if LLVM_VERSION_CODE >= LLVM_VERSION(11, 0)
-  addPass(PM, createSCCPPass());                 // Constant prop with SCCP
-#else
-  addPass(PM, createIPConstantPropagationPass());// IP Constant Propagation
-#endif
-  addPass(PM, createDeadArgEliminationPass());   // Dead argument elimination
-  addPass(PM, createInstructionCombiningPass()); // Clean up after IPCP & DAE
-  addPass(PM, createCFGSimplificationPass());    // Clean up after IPCP & DAE
-
-  addPass(PM, createPruneEHPass());              // Remove dead EH info
-  addPass(PM, createPostOrderFunctionAttrsLegacyPass());
-  addPass(PM, createReversePostOrderFunctionAttrsPass()); // Deduce function attrs
-
-  if (!DisableInline)
-    addPass(PM, createFunctionInliningPass());   // Inline small functions
-  addPass(PM, createArgumentPromotionPass());    // Scalarize uninlined fn args
-
-  addPass(PM, createInstructionCombiningPass()); // Cleanup for scalarrepl.
-  addPass(PM, createJumpThreadingPass());        // Thread jumps.
-  addPass(PM, createCFGSimplificationPass());    // Merge & remove BBs
-  addPass(PM, createSROAPass());                 // Break up aggregate allocas
-  addPass(PM, createInstructionCombiningPass()); // Combine silly seq's
-
-  addPass(PM, createTailCallEliminationPass());  // Eliminate tail calls
-  addPass(PM, createCFGSimplificationPass());    // Merge & remove BBs
-  addPass(PM, createReassociatePass());          // Reassociate expressions
-  addPass(PM, createLoopRotatePass());
-  addPass(PM, createLICMPass());                 // Hoist loop invariants
-  addPass(PM, createLoopUnswitchPass());         // Unswitch loops.
-  // FIXME : Removing instcombine causes nestedloop regression.
-  addPass(PM, createInstructionCombiningPass());
-  addPass(PM, createIndVarSimplifyPass());       // Canonicalize indvars
-  addPass(PM, createLoopDeletionPass());         // Delete dead loops
-  addPass(PM, createLoopUnrollPass());           // Unroll small loops
-  addPass(PM, createInstructionCombiningPass()); // Clean up after the unroller
-  addPass(PM, createGVNPass());                  // Remove redundancies
-  addPass(PM, createMemCpyOptPass());            // Remove memcpy / form memset
-  addPass(PM, createSCCPPass());                 // Constant prop with SCCP
-
-  // Run instcombine after redundancy elimination to exploit opportunities
-  // opened up by them.
-  addPass(PM, createInstructionCombiningPass());
-
-  addPass(PM, createDeadStoreEliminationPass()); // Delete dead stores
-  addPass(PM, createAggressiveDCEPass());        // Delete dead instructions
-  addPass(PM, createCFGSimplificationPass());    // Merge & remove BBs
-  addPass(PM, createStripDeadPrototypesPass());  // Get rid of dead prototypes
-  addPass(PM, createConstantMergePass());        // Merge dup global constants
+static cl::opt<unsigned> OptThreads(
+    "opt-threads",
+    cl::desc("Number of threads running the function passes of an "
+             "--opt-pipeline profile, 0 uses all cores (default=1)"),
+    cl::init(1), cl::cat(linker::ModuleCat));
+
+// Expands Spec into a pipeline without profile references. Spec is either
+// the name of a profile or a pipeline in which "@profile" stands for the
+// passes of that profile.
+static std::string expandPipeline(StringRef Spec) {
+  Spec = Spec.trim();
+  if (const OptProfile *P = findProfile(Spec))
+    return expandPipeline(P->pipeline);
+
+  std::string Result;
+  for (;;) {
+    std::pair<StringRef, StringRef> Split = Spec.split('@');
+    Result += Split.first.str();
+    if (Split.first.size() == Spec.size())
+      break;
+    size_t End = Split.second.find_first_of(",()");
+    StringRef Name = Split.second.substr(0, End);
+    const OptProfile *P = findProfile(Name);
+    if (!P)
+      linker::linker_error("--opt-pipeline: unknown profile '%s'",
+                           Name.str().c_str());
+    Result += expandPipeline(P->pipeline);
+    Spec = Split.second.substr(Name.size());
+  }
+  return Result;
 }
 
-/// Optimize - Perform link time optimizations. This will run the scalar
-/// optimizations, any loaded plugin-optimization modules, and then the
-/// inter-procedural optimizations if applicable.
-void Optimize(Module *M, llvm::ArrayRef<const char *> preservedFunctions) {
-
-  // Instantiate the pass manager to organize the passes.
-  legacy::PassManager Passes;
+// Makes fs-inline, fs-internalize, fs-constify-globals, fs-simplifycfg and
+// fs-solver-canon available in pipelines.
+static void registerLinkerPasses(PassBuilder &PB,
+                                 llvm::ArrayRef<const char *> preservedFunctions) {
+  // Scan through the module, looking for a main function. If main is
+  // defined, mark all other functions internal.
+  auto PreserveFunctions = [=](const GlobalValue &GV) {
+    StringRef GVName = GV.getName();
+
+    for (const char *fun : preservedFunctions)
+      if (GVName.equals(fun))
+        return true;
+
+    return false;
+  };
+
+  PB.registerPipelineParsingCallback(
+      [=](StringRef Name, ModulePassManager &MPM,
+          ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "fs-internalize") {
+          if (!DisableInternalize)
+            MPM.addPass(InternalizePass(PreserveFunctions));
+          return true;
+        }
+        if (Name == "fs-inline") {
+          if (!DisableInline)
+            MPM.addPass(createModuleToPostOrderCGSCCPassAdaptor(InlinerPass()));
+          return true;
+        }
+        if (Name == "fs-constify-globals") {
+          MPM.addPass(linker::ConstifyGlobalsPass());
+          return true;
+        }
+        return false;
+      });
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, CGSCCPassManager &CGPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name != "fs-inline")
+          return false;
+        if (!DisableInline)
+          CGPM.addPass(InlinerPass()); // Inline small functions
+        return true;
+      });
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, FunctionPassManager &FPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "fs-simplifycfg") {
+          FPM.addPass(
+              SimplifyCFGPass(linker::getBranchPreservingSimplifyCFGOptions()));
+          return true;
+        }
+        if (Name == "fs-solver-canon") {
+          FPM.addPass(linker::SolverCanonicalizePass());
+          return true;
+        }
+        return false;
+      });
+}
 
-  // If we're verifying, start off with a verification pass.
-  if (VerifyEach)
-    Passes.add(createVerifierPass());
+namespace {
+// A share of the function bodies of the module. It is optimized as bitcode in
+// a context of its own, so that partitions can run on different threads.
+struct Partition {
+  std::vector<Function *> functions;
+  uint64_t size = 0;
+  SmallVector<char, 0> bitcode;
+};
+} // namespace
+
+// Runs the function passes Pipeline over the module in Bitcode and replaces
+// Bitcode with the result.
+static void optimizePartition(SmallVectorImpl<char> &Bitcode,
+                              StringRef Pipeline,
+                              ArrayRef<const char *> preservedFunctions,
+                              bool VerifyEach) {
+  LLVMContext Context;
+  Expected<std::unique_ptr<Module>> M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), "partition"),
+      Context);
+  if (!M)
+    linker::linker_error("--opt-threads: %s",
+                         toString(M.takeError()).c_str());
+
+  {
+    linker::PassContext Ctx(VerifyEach);
+    PassBuilder PB(nullptr, PipelineTuningOptions(), None, &Ctx.PIC);
+    registerLinkerPasses(PB, preservedFunctions);
+
+    ModulePassManager Passes;
+    cantFail(PB.parsePassPipeline(Passes, ("function(" + Pipeline + ")").str()));
+    Passes.run(**M, Ctx.MAM);
+  }
 
-  // DWD - Run the opt standard pass list as well.
-  AddStandardCompilePasses(Passes);
+  Bitcode.clear();
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(**M, OS);
+}
 
-  // Now that composite has been compiled, scan through the module, looking
-  // for a main function.  If main is defined, mark all other functions
-  // internal.
-  if (!DisableInternalize) {
-    auto PreserveFunctions = [=](const GlobalValue &GV) {
-      StringRef GVName = GV.getName();
+// Every partition brings along its own copy of the compile units listed in
+// llvm.dbg.cu, appended in the original order. Points the moved subprograms
+// back at the units of M, which leaves the copies unreferenced.
+static void mergeCompileUnits(Module &M, ArrayRef<DICompileUnit *> Units) {
+  NamedMDNode *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  if (!CUs || Units.empty() || CUs->getNumOperands() % Units.size())
+    return;
+
+  DenseMap<const MDNode *, DICompileUnit *> Original;
+  for (unsigned i = Units.size(), e = CUs->getNumOperands(); i != e; ++i)
+    Original[CUs->getOperand(i)] = Units[i % Units.size()];
+
+  DebugInfoFinder Finder;
+  Finder.processModule(M);
+  for (DISubprogram *SP : Finder.subprograms())
+    if (DICompileUnit *CU = Original.lookup(SP->getUnit()))
+      SP->replaceUnit(CU);
+
+  CUs->clearOperands();
+  for (DICompileUnit *CU : Units)
+    CUs->addOperand(CU);
+}
 
-      for (const char *fun : preservedFunctions)
-        if (GVName.equals(fun))
-          return true;
+// Runs the function passes Pipeline over every function of M, with the
+// bodies spread over Threads partitions. Each partition holds its bodies,
+// declarations of everything else and available_externally copies of the
+// constant globals, and is linked back into M by name once optimized.
+// Bodies that cannot be moved on their own (comdat members and targets of
+// blockaddress) are optimized in place on this thread meanwhile.
+static void optimizeFunctionsInParallel(
+    Module &M, StringRef Pipeline, ArrayRef<const char *> preservedFunctions,
+    linker::PassContext &Ctx, unsigned Threads) {
+  std::vector<Function *> pinned, movable;
+  std::vector<DICompileUnit *> units(M.debug_compile_units_begin(),
+                                     M.debug_compile_units_end());
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    bool addressTaken = std::any_of(
+        F.begin(), F.end(), [](BasicBlock &BB) { return BB.hasAddressTaken(); });
+    if (F.hasComdat() || addressTaken)
+      pinned.push_back(&F);
+    else
+      movable.push_back(&F);
+  }
 
-      return false;
-    };
-    ModulePass *pass = createInternalizePass(PreserveFunctions);
-    addPass(Passes, pass);
+  // Assign the largest bodies first, each to the smallest partition so far.
+  std::stable_sort(movable.begin(), movable.end(),
+                   [](const Function *A, const Function *B) {
+                     return A->getInstructionCount() >
+                            B->getInstructionCount();
+                   });
+  std::vector<Partition> partitions(
+      std::max<size_t>(1, std::min<size_t>(Threads, movable.size())));
+  for (Function *F : movable) {
+    Partition &P = *std::min_element(
+        partitions.begin(), partitions.end(),
+        [](const Partition &A, const Partition &B) { return A.size < B.size; });
+    P.functions.push_back(F);
+    P.size += F->getInstructionCount();
   }
 
-  // Propagate constants at call sites into the functions they call.  This
-  // opens opportunities for globalopt (and inlining) by substituting function
-  // pointers passed as arguments to direct uses of functions.
-  addPass(Passes, createIPSCCPPass());
+  // Partitions are linked back by name, so local symbols are made external
+  // while the bodies are away.
+  struct LocalSymbol {
+    std::string name;
+    GlobalValue::LinkageTypes linkage;
+    bool unnamed;
+  };
+  std::vector<LocalSymbol> locals;
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage())
+      continue;
+    bool unnamed = !GV.hasName();
+    if (unnamed)
+      GV.setName("fs.partition.local");
+    locals.push_back({GV.getName().str(), GV.getLinkage(), unnamed});
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+  }
+  // Linked bodies are appended to the module, the original order is
+  // restored afterwards.
+  std::vector<std::string> order;
+  for (Function &F : M)
+    order.push_back(F.getName().str());
+
+  for (Partition &P : partitions) {
+    SmallPtrSet<const GlobalValue *, 32> members(P.functions.begin(),
+                                                 P.functions.end());
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Part =
+        CloneModule(M, VMap, [&](const GlobalValue *GV) {
+          if (const auto *Var = dyn_cast<GlobalVariable>(GV))
+            return Var->isConstant() && !Var->isInterposable() &&
+                   !Var->getName().startswith("llvm.");
+          return members.count(GV) != 0;
+        });
+    for (GlobalVariable &Var : Part->globals()) {
+      if (!Var.hasInitializer())
+        continue;
+      Var.setLinkage(GlobalValue::AvailableExternallyLinkage);
+      Var.setComdat(nullptr);
+    }
+    // Only keep what the linker cannot duplicate.
+    Part->setModuleInlineAsm("");
+    for (NamedMDNode &NMD : make_early_inc_range(Part->named_metadata()))
+      if (NMD.getName() != "llvm.dbg.cu" &&
+          NMD.getName() != "llvm.module.flags")
+        Part->eraseNamedMetadata(&NMD);
+
+    raw_svector_ostream OS(P.bitcode);
+    WriteBitcodeToFile(*Part, OS);
+  }
 
-  // Now that we internalized some globals, see if we can hack on them!
-  addPass(Passes, createGlobalOptimizerPass());
+  {
+    ThreadPool Pool(hardware_concurrency(partitions.size()));
+    for (Partition &P : partitions)
+      Pool.async([&P, Pipeline, preservedFunctions, &Ctx] {
+        optimizePartition(P.bitcode, Pipeline, preservedFunctions,
+                          Ctx.VerifyEach);
+      });
+
+    if (!pinned.empty()) {
+      PassBuilder PB(nullptr, PipelineTuningOptions(), None, &Ctx.PIC);
+      registerLinkerPasses(PB, preservedFunctions);
+      FunctionPassManager FPM;
+      cantFail(PB.parsePassPipeline(FPM, Pipeline));
+      for (Function *F : pinned)
+        FPM.run(*F, Ctx.FAM);
+    }
+    Pool.wait();
+  }
+  Ctx.clear();
+
+  for (Partition &P : partitions)
+    for (Function *F : P.functions)
+      F->deleteBody();
+
+  Linker L(M);
+  for (Partition &P : partitions) {
+    Expected<std::unique_ptr<Module>> Part = parseBitcodeFile(
+        MemoryBufferRef(StringRef(P.bitcode.data(), P.bitcode.size()),
+                        "partition"),
+        M.getContext());
+    if (!Part)
+      linker::linker_error("--opt-threads: %s",
+                           toString(Part.takeError()).c_str());
+    if (L.linkInModule(std::move(*Part)))
+      linker::linker_error("--opt-threads: cannot link optimized partition");
+  }
+  mergeCompileUnits(M, units);
 
-  // Linking modules together can lead to duplicated global constants, only
-  // keep one copy of each constant...
-  addPass(Passes, createConstantMergePass());
+  for (const std::string &name : order) {
+    Function *F = M.getFunction(name);
+    F->removeFromParent();
+    M.getFunctionList().push_back(F);
+  }
 
-  // Remove unused arguments from functions...
-  addPass(Passes, createDeadArgEliminationPass());
+  for (const LocalSymbol &Local : locals) {
+    GlobalValue *GV = M.getNamedValue(Local.name);
+    if (!GV)
+      continue;
+    GV->setLinkage(Local.linkage);
+    if (Local.unnamed)
+      GV->setName("");
+  }
+}
 
-  // Reduce the code after globalopt and ipsccp.  Both can open up significant
-  // simplification opportunities, and both can propagate functions through
-  // function pointers.  When this happens, we often have to resolve varargs
-  // calls, etc, so let instcombine do this.
-  addPass(Passes, createInstructionCombiningPass());
+namespace llvm {
 
-  if (!DisableInline)
-    addPass(Passes, createFunctionInliningPass()); // Inline small functions
+/// Optimize - Perform link time optimizations. This will run the scalar
+/// optimizations, any loaded plugin-optimization modules, and then the
+/// inter-procedural optimizations if applicable.
+void Optimize(Module *M, llvm::ArrayRef<const char *> preservedFunctions,
+              linker::PassContext &Ctx) {
+  PassBuilder PB(nullptr, PipelineTuningOptions(), None, &Ctx.PIC);
+  registerLinkerPasses(PB, preservedFunctions);
 
-  addPass(Passes, createPruneEHPass());         // Remove dead EH info
-  addPass(Passes, createGlobalOptimizerPass()); // Optimize globals again.
-  addPass(Passes, createGlobalDCEPass());       // Remove dead functions
+  // If the -strip-debug command line option was specified, do it.
+  if (StripDebug)
+    StripDebugInfo(*M);
+
+  // Only the profiles know which of their passes may run on a part of the
+  // module, so custom pipelines are always run on one thread.
+  unsigned Threads = OptThreads ? OptThreads.getValue()
+                                : hardware_concurrency().compute_thread_count();
+  const OptProfile *Profile = findProfile(StringRef(OptPipeline).trim());
+  if (Threads > 1 && !Profile) {
+    linker::linker_message("--opt-threads: '%s' is not a profile, optimizing "
+                           "on one thread",
+                           OptPipeline.c_str());
+    Threads = 1;
+  }
 
-  // If we didn't decide to inline a function, check to see if we can
-  // transform it to pass arguments by value instead of by reference.
-  addPass(Passes, createArgumentPromotionPass());
+  ModulePassManager Passes;
+  Passes.addPass(VerifierPass()); // Verify that input is correct
 
-  // The IPO passes may leave cruft around.  Clean up after them.
-  addPass(Passes, createInstructionCombiningPass());
-  addPass(Passes, createJumpThreadingPass()); // Thread jumps.
-  addPass(Passes, createSROAPass()); // Break up allocas
+  std::string Pipeline =
+      expandPipeline(Threads > 1 ? Profile->ipo : OptPipeline.getValue());
+  if (auto Err = PB.parsePassPipeline(Passes, Pipeline))
+    linker::linker_error("--opt-pipeline: %s",
+                         toString(std::move(Err)).c_str());
 
-  // Run a few AA driven optimizations here and now, to cleanup the code.
-  addPass(Passes, createPostOrderFunctionAttrsLegacyPass());
-  addPass(Passes, createReversePostOrderFunctionAttrsPass()); // Add nocapture
-  addPass(Passes, createGlobalsAAWrapperPass()); // IP alias analysis
+  if (Threads > 1) {
+    Passes.run(*M, Ctx.MAM);
+    Ctx.clear();
+    optimizeFunctionsInParallel(*M, Profile->function, preservedFunctions,
+                                Ctx, Threads);
 
-  addPass(Passes, createLICMPass());                 // Hoist loop invariants
-  addPass(Passes, createGVNPass());                  // Remove redundancies
-  addPass(Passes, createMemCpyOptPass());            // Remove dead memcpy's
-  addPass(Passes, createDeadStoreEliminationPass()); // Nuke dead stores
+    // Bodies may have stopped referring to other functions.
+    Passes = ModulePassManager();
+    Passes.addPass(GlobalDCEPass());
+  }
 
-  // Cleanup and simplify the code after the scalar optimizations.
-  addPass(Passes, createInstructionCombiningPass());
+  // If the -s command line option was specified, strip the symbols out of the
+  // resulting program to make it smaller.  -s and -S are GNU ld options that
+  // we are supporting; they alias -strip-all and -strip-debug.
+  if (Strip)
+    Passes.addPass(StripSymbolsPass());
 
-  addPass(Passes, createJumpThreadingPass());           // Thread jumps.
-  addPass(Passes, createPromoteMemoryToRegisterPass()); // Cleanup jumpthread.
+  // Run our queue of passes all at once now, efficiently.
+  Passes.run(*M, Ctx.MAM);
+}
 
-  // Delete basic blocks, which optimization passes may have killed...
-  addPass(Passes, createCFGSimplificationPass());
+// Returns true if F is one of the libc memory routines, whatever their
+// prefix, or one of those of the string runtime.
+static bool isMemoryRoutine(const Function &F) {
+  for (const char *Routine : {"memcpy", "memmove", "mempcpy", "memset",
+                              "bcopy", "bzero"})
+    if (F.getName().endswith(Routine))
+      return true;
+  return false;
+}
 
-  // Now that we have optimized the program, discard unreachable functions...
-  addPass(Passes, createGlobalDCEPass());
+// Collects the functions whose loops loop idiom recognition must not turn
+// into memcpy or memset calls, since those calls could end up in the function
+// itself: the memory routines and every function they call, directly or not,
+// such as the word copy helpers of libc.
+static SmallPtrSet<const Function *, 16> collectMemoryHelpers(Module &M) {
+  SmallPtrSet<const Function *, 16> Helpers;
+  std::vector<const Function *> Worklist;
+  for (Function &F : M)
+    if (isMemoryRoutine(F) && Helpers.insert(&F).second)
+      Worklist.push_back(&F);
+  while (!Worklist.empty()) {
+    const Function *F = Worklist.back();
+    Worklist.pop_back();
+    for (const Instruction &I : instructions(*F))
+      if (const auto *Call = dyn_cast<CallBase>(&I))
+        if (const auto *Callee = dyn_cast<Function>(
+                Call->getCalledOperand()->stripPointerCasts()))
+          if (Helpers.insert(Callee).second)
+            Worklist.push_back(Callee);
+  }
+  return Helpers;
+}
 
-  // If the -s or -S command line options were specified, strip the symbols out
-  // of the resulting program to make it smaller.  -s and -S are GNU ld options
-  // that we are supporting; they alias -strip-all and -strip-debug.
-  if (Strip || StripDebug)
-    addPass(Passes, createStripSymbolsPass(StripDebug && !Strip));
+/// Cleanup - Perform the cheap cleanups of --cleanup, which leave the
+/// control flow of the program alone.
+void Cleanup(Module *M, linker::PassContext &Ctx) {
+  PassBuilder PB(nullptr, PipelineTuningOptions(), None, &Ctx.PIC);
+  registerLinkerPasses(PB, None);
 
-  // The user's passes may leave cruft around; clean up after them.
-  addPass(Passes, createInstructionCombiningPass());
-  addPass(Passes, createCFGSimplificationPass());
-  addPass(Passes, createAggressiveDCEPass());
-  addPass(Passes, createGlobalDCEPass());
+  ModulePassManager Passes;
+  cantFail(PB.parsePassPipeline(Passes, cleanupPipeline));
+  Passes.run(*M, Ctx.MAM);
+}
 
-  // Run our queue of passes all at once now, efficiently.
-  Passes.run(*M);
+void RecognizeLoopIdioms(Module *M, linker::PassContext &Ctx) {
+  PassBuilder PB(nullptr, PipelineTuningOptions(), None, &Ctx.PIC);
+  registerLinkerPasses(PB, None);
+
+  FunctionPassManager Passes;
+  cantFail(PB.parsePassPipeline(Passes, loopIdiomPipeline));
+  SmallPtrSet<const Function *, 16> Helpers = collectMemoryHelpers(*M);
+  for (Function &F : *M) {
+    // Functions built with -fno-builtin implement what the builtins would
+    // be replaced with.
+    if (F.isDeclaration() || Helpers.count(&F) ||
+        F.hasFnAttribute("no-builtins") ||
+        F.hasFnAttribute(Attribute::NoBuiltin))
+      continue;
+    PreservedAnalyses PA = Passes.run(F, Ctx.FAM);
+    Ctx.FAM.invalidate(F, PA);
+  }
 }
 }
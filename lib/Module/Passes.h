@@ -12,30 +12,79 @@
 
 #include "fs-linker/Config/Version.h"
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/CodeGen/IntrinsicLowering.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
-#include "llvm/Pass.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Transforms/Utils/SimplifyCFGOptions.h"
+
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace llvm {
+class DemandedBits;
 class Function;
 class Instruction;
+class LazyValueInfo;
 class Module;
 class DataLayout;
 class TargetLowering;
+class TargetMachine;
 class Type;
 } // namespace llvm
 
 namespace linker {
 
-/// RaiseAsmPass - This pass raises some common occurences of inline
-/// asm which are used by glibc into normal LLVM IR.
-class RaiseAsmPass : public llvm::ModulePass {
-  static char ID;
+/// PassContext - The analysis managers shared by every pass pipeline that is
+/// run over a module. Keeping them alive across stages lets analyses such as
+/// the dominator tree and loop info survive from one pipeline to the next as
+/// long as the passes in between preserve them.
+struct PassContext {
+  llvm::PassInstrumentationCallbacks PIC;
+  llvm::StandardInstrumentations SI;
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+
+  const bool VerifyEach;
+
+  explicit PassContext(bool VerifyEach);
 
+  /// Drop all cached results, e.g. when the module has been replaced.
+  void clear();
+};
+
+/// getBranchPreservingSimplifyCFGOptions - SimplifyCFG options that keep
+/// branches as branches: no speculation into selects, no switch lookup
+/// tables and no merging of conditions.
+inline llvm::SimplifyCFGOptions getBranchPreservingSimplifyCFGOptions() {
+  return llvm::SimplifyCFGOptions()
+      .forwardSwitchCondToPhi(false)
+      .convertSwitchToLookupTable(false)
+      .needCanonicalLoops(true)
+      .hoistCommonInsts(false)
+      .sinkCommonInsts(false)
+      .setSimplifyCondBranch(false)
+      .setFoldTwoEntryPHINode(false);
+}
+
+/// RaiseAsmPass - This pass raises some common occurences of inline
+/// asm which are used by glibc into normal LLVM IR. Besides what the target
+/// lowering can expand, a table of x86 patterns is tried and any asm that is
+/// left is reported.
+class RaiseAsmPass : public llvm::PassInfoMixin<RaiseAsmPass> {
   const llvm::TargetLowering *TLI;
+  const llvm::TargetMachine *TM;
 
   llvm::Triple triple;
 
@@ -48,27 +97,26 @@ class RaiseAsmPass : public llvm::ModulePass {
   bool runOnInstruction(llvm::Module &M, llvm::Instruction *I);
 
 public:
-  RaiseAsmPass() : llvm::ModulePass(ID), TLI(0) {}
+  explicit RaiseAsmPass(const llvm::TargetMachine *TM) : TLI(0), TM(TM) {}
 
-  bool runOnModule(llvm::Module &M) override;
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
 };
 
 // This is a module pass because it can add and delete module
 // variables (via intrinsic lowering).
-class IntrinsicCleanerPass : public llvm::ModulePass {
-  static char ID;
+class IntrinsicCleanerPass : public llvm::PassInfoMixin<IntrinsicCleanerPass> {
   const llvm::DataLayout &DataLayout;
-  llvm::IntrinsicLowering *IL;
+  std::unique_ptr<llvm::IntrinsicLowering> IL;
 
   bool runOnBasicBlock(llvm::BasicBlock &b, llvm::Module &M);
 
 public:
   IntrinsicCleanerPass(const llvm::DataLayout &TD)
-      : llvm::ModulePass(ID), DataLayout(TD),
-        IL(new llvm::IntrinsicLowering(TD)) {}
-  ~IntrinsicCleanerPass() { delete IL; }
+      : DataLayout(TD), IL(new llvm::IntrinsicLowering(TD)) {}
 
-  bool runOnModule(llvm::Module &M) override;
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
 };
 
 // performs two transformations which make interpretation
@@ -83,24 +131,21 @@ public:
 //    a subsequent PHI node in the same basic block. This allows
 //    the transfer to execute the instructions in order instead
 //    of in two passes.
-class PhiCleanerPass : public llvm::FunctionPass {
-  static char ID;
-
+class PhiCleanerPass : public llvm::PassInfoMixin<PhiCleanerPass> {
 public:
-  PhiCleanerPass() : llvm::FunctionPass(ID) {}
-
-  bool runOnFunction(llvm::Function &f) override;
+  bool runOnFunction(llvm::Function &f);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
 };
 
 /// LowerSwitchPass - Replace all SwitchInst instructions with chained branch
 /// instructions.  Note that this cannot be a BasicBlock pass because it
 /// modifies the CFG!
-class LowerSwitchPass : public llvm::FunctionPass {
+class LowerSwitchPass : public llvm::PassInfoMixin<LowerSwitchPass> {
 public:
-  static char ID; // Pass identification, replacement for typeid
-  LowerSwitchPass() : FunctionPass(ID) {}
-
-  bool runOnFunction(llvm::Function &F) override;
+  bool runOnFunction(llvm::Function &F);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
 
   struct SwitchCase {
     llvm ::Constant *value;
@@ -123,29 +168,62 @@ private:
 /// InstructionOperandTypeCheckPass - Type checks the types of instruction
 /// operands to check that they conform to invariants expected by the Linker.
 ///
-/// This is a ModulePass because other pass types are not meant to maintain
-/// state between calls.
-class InstructionOperandTypeCheckPass : public llvm::ModulePass {
+/// This is a module pass because the result is queried after it has run.
+/// It is run directly instead of through a pass manager for that reason.
+class InstructionOperandTypeCheckPass
+    : public llvm::PassInfoMixin<InstructionOperandTypeCheckPass> {
 private:
   bool instructionOperandsConform;
+  // Accept the vector instructions kept by SelectiveScalarizerPass
+  bool allowNativeVectors;
 
 public:
-  static char ID;
-  InstructionOperandTypeCheckPass()
-      : llvm::ModulePass(ID), instructionOperandsConform(true) {}
-  bool runOnModule(llvm::Module &M) override;
+  explicit InstructionOperandTypeCheckPass(bool allowNativeVectors = false)
+      : instructionOperandsConform(true),
+        allowNativeVectors(allowNativeVectors) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
   bool checkPassed() const { return instructionOperandsConform; }
+
+  /// Checks the instructions of F without printing anything. A message is
+  /// appended to messages for every violation. Only reads F, so different
+  /// functions may be checked concurrently.
+  static bool checkFunction(const llvm::Function &F,
+                            std::vector<std::string> &messages,
+                            bool allowNativeVectors = false);
+};
+
+/// SelectiveScalarizerPass - Scalarizes only the vector instructions the
+/// Engine cannot execute natively. Vector loads, stores and element-wise
+/// integer operations are kept. Divisions and shifts are scalarized as well
+/// when they are going to be checked, since DivCheckPass and
+/// OvershiftCheckPass only instrument scalar operations.
+class SelectiveScalarizerPass
+    : public llvm::PassInfoMixin<SelectiveScalarizerPass> {
+  bool splitDivisions;
+  bool splitShifts;
+
+public:
+  SelectiveScalarizerPass(bool splitDivisions = false,
+                          bool splitShifts = false)
+      : splitDivisions(splitDivisions), splitShifts(splitShifts) {}
+
+  /// Returns true if the Engine executes I as is when it involves vectors.
+  static bool isNativeVectorInstruction(const llvm::Instruction &I);
+
+  bool runOnFunction(llvm::Function &F);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
 };
 
 /// FunctionAliasPass - Enables a user to specify aliases to functions
 /// using -function-alias=<name|pattern>:<replacement> which are injected as
 /// GlobalAliases into the module. The replaced function is removed.
-class FunctionAliasPass : public llvm::ModulePass {
+class FunctionAliasPass : public llvm::PassInfoMixin<FunctionAliasPass> {
 
 public:
-  static char ID;
-  FunctionAliasPass() : llvm::ModulePass(ID) {}
-  bool runOnModule(llvm::Module &M) override;
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
 
 private:
   static const llvm::FunctionType *getFunctionType(const llvm::GlobalValue *gv);
@@ -155,12 +233,219 @@ private:
 
 };
 
-/// Instruments every function that contains a Engine function call as nonopt
-class OptNonePass : public llvm::ModulePass {
+/// MergeStructTypesPass - Merges the named struct types that linking left
+/// behind as renamed but structurally identical copies and rewrites the
+/// module to use one type for each.
+class MergeStructTypesPass : public llvm::PassInfoMixin<MergeStructTypesPass> {
+public:
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// ConstifyGlobalsPass - Marks the internal globals whose memory is never
+/// written, and whose address does not escape, as constant.
+class ConstifyGlobalsPass : public llvm::PassInfoMixin<ConstifyGlobalsPass> {
+public:
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// MergeFunctionsPass - Replaces functions that are equal up to pointer types
+/// with one copy. Preserved functions, optnone functions and functions whose
+/// distinct address may be relied upon are kept.
+class MergeFunctionsPass : public llvm::PassInfoMixin<MergeFunctionsPass> {
+  std::vector<std::string> preservedFunctions;
+
+public:
+  explicit MergeFunctionsPass(llvm::ArrayRef<const char *> preservedFunctions);
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// SpecializeConstantArgsPass - Clones functions for the integer constants
+/// that several of their call sites, or a hot one, pass, folds the constants
+/// in the clone and calls it instead. At most maxClones clones are made.
+class SpecializeConstantArgsPass
+    : public llvm::PassInfoMixin<SpecializeConstantArgsPass> {
+  unsigned maxClones;
+
+public:
+  explicit SpecializeConstantArgsPass(unsigned maxClones)
+      : maxClones(maxClones) {}
+  bool runOnModule(llvm::Module &M, llvm::FunctionAnalysisManager &FAM);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// ReplaceLibcPass - Redirects calls of libc string and memory routines, and
+/// the memory intrinsics, to the __fs_ versions of the string runtime
+/// library. Only the routines in functions are replaced, or all of them if
+/// it is empty.
+class ReplaceLibcPass : public llvm::PassInfoMixin<ReplaceLibcPass> {
+  std::vector<std::string> functions;
+
+public:
+  explicit ReplaceLibcPass(std::vector<std::string> functions)
+      : functions(std::move(functions)) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// ConcreteOnlyPass - Marks the functions that provably never touch symbolic
+/// data with the "fs-concrete-only" attribute, using an interprocedural
+/// taint analysis, and writes their names to listFile if it is given.
+class ConcreteOnlyPass : public llvm::PassInfoMixin<ConcreteOnlyPass> {
+  std::string listFile;
+
+public:
+  explicit ConcreteOnlyPass(llvm::StringRef listFile) : listFile(listFile) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// PointsToPass - Runs an Andersen-style points-to analysis over the module,
+/// numbers the allocation sites with !fs.site and annotates the loads and
+/// stores that may only access known sites with !fs.pts. The sites are
+/// written to tableFile if it is given.
+class PointsToPass : public llvm::PassInfoMixin<PointsToPass> {
+  std::string tableFile;
+
+public:
+  explicit PointsToPass(llvm::StringRef tableFile) : tableFile(tableFile) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// NarrowIntWidthPass - Narrows integer arithmetic whose high bits are never
+/// used, and comparisons of values known to be small, to 8, 16 or 32 bits,
+/// so that the Engine builds narrower solver terms.
+class NarrowIntWidthPass : public llvm::PassInfoMixin<NarrowIntWidthPass> {
+public:
+  bool runOnFunction(llvm::Function &F, llvm::DemandedBits &DB,
+                     llvm::LazyValueInfo &LVI);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
+};
+
+/// IfConvertPass - Flattens diamonds and triangles whose side blocks have at
+/// most threshold instructions, all safe to speculate, into selects, so that
+/// the Engine does not fork on their branch.
+class IfConvertPass : public llvm::PassInfoMixin<IfConvertPass> {
+  unsigned threshold;
+
+public:
+  explicit IfConvertPass(unsigned threshold) : threshold(threshold) {}
+  bool runOnFunction(llvm::Function &F);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
+};
+
+/// LoopMetadataPass - Annotates loop headers, the blocks leaving loops and
+/// induction variables with what LoopInfo and ScalarEvolution know about
+/// them, including trip counts, and writes the loops to sidecarFile as JSON
+/// if it is given.
+class LoopMetadataPass : public llvm::PassInfoMixin<LoopMetadataPass> {
+  std::string sidecarFile;
+
+public:
+  explicit LoopMetadataPass(llvm::StringRef sidecarFile)
+      : sidecarFile(sidecarFile) {}
+  bool runOnModule(llvm::Module &M, llvm::FunctionAnalysisManager &FAM);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// ComplexityReport - Writes per-function metrics of what makes a function
+/// expensive to execute symbolically as CSV: branches, switches and their
+/// cases before and after switch lowering, loops, indirect calls, inline asm,
+/// floating point operations and Engine calls.
+class ComplexityReport {
+  // Number of switches and of their cases per function, before lowering.
+  llvm::StringMap<std::pair<unsigned, unsigned>> switchesBefore;
+
+public:
+  /// Records the switches of M; call before the switches are lowered.
+  void recordSwitches(llvm::Module &M);
+  void write(llvm::Module &M, llvm::FunctionAnalysisManager &FAM,
+             llvm::StringRef reportFile);
+};
+
+/// isEngineFunction - Returns true if F is part of the Engine API, going by
+/// its name.
+bool isEngineFunction(const llvm::Function &F);
+
+/// Instruments every function that contains a Engine function call as nonopt.
+/// With outlineRegions set, or for functions marked hot, only the runs of
+/// Engine calls are moved into separate nonopt functions and the rest of the
+/// caller stays optimizable.
+class OptNonePass : public llvm::PassInfoMixin<OptNonePass> {
+  bool outlineRegions;
+  // Set by runOnModule if it split blocks or outlined regions of a function.
+  bool cfgChanged = false;
+
+public:
+  explicit OptNonePass(bool outlineRegions = false)
+      : outlineRegions(outlineRegions) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// EngineProfilePass - Applies a per-function profile of earlier Engine runs.
+/// The functions that account for hotPercent of the executions are marked
+/// hot and inlinehint; listed functions that never ran are marked cold,
+/// noinline and optnone so the optimizer leaves them untouched.
+class EngineProfilePass : public llvm::PassInfoMixin<EngineProfilePass> {
+  std::string profilePath;
+  unsigned hotPercent;
+
+public:
+  EngineProfilePass(llvm::StringRef profilePath, unsigned hotPercent)
+      : profilePath(profilePath), hotPercent(hotPercent) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// DivCheckPass - Inserts a call to klee_div_zero_check before every
+/// division and remainder whose divisor cannot be proven non-zero.
+class DivCheckPass : public llvm::PassInfoMixin<DivCheckPass> {
+public:
+  bool runOnModule(llvm::Module &M, llvm::FunctionAnalysisManager &FAM);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// OvershiftCheckPass - Inserts a call to klee_overshift_check before every
+/// shift whose amount cannot be proven smaller than the bit width.
+class OvershiftCheckPass : public llvm::PassInfoMixin<OvershiftCheckPass> {
+public:
+  bool runOnModule(llvm::Module &M, llvm::FunctionAnalysisManager &FAM);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// stripCheckMarkers - Removes the markers DivCheckPass and OvershiftCheckPass
+/// leave on the instructions they checked or proved safe, once no module is
+/// going to be instrumented anymore.
+void stripCheckMarkers(llvm::Module &M);
+
+/// StartupEvaluatorPass - Runs the static constructors and the deterministic
+/// prefix of uClibc's initialization at link time and folds their effects
+/// into the global initializers.
+class StartupEvaluatorPass : public llvm::PassInfoMixin<StartupEvaluatorPass> {
+  std::string entryPoint;
+
+public:
+  explicit StartupEvaluatorPass(llvm::StringRef entryPoint)
+      : entryPoint(entryPoint) {}
+  bool runOnModule(llvm::Module &M);
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+};
+
+/// SolverCanonicalizePass - Rewrites divisions by a constant that were
+/// expanded into a multiply by a magic number and a shift back into udiv,
+/// and the matching remainder computations back into urem.
+class SolverCanonicalizePass
+    : public llvm::PassInfoMixin<SolverCanonicalizePass> {
 public:
-  static char ID;
-  OptNonePass() : llvm::ModulePass(ID) {}
-  bool runOnModule(llvm::Module &M) override;
+  bool runOnFunction(llvm::Function &F);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
 };
 } // namespace linker
 
@@ -13,8 +13,6 @@
 
 using namespace llvm;
 
-char linker::PhiCleanerPass::ID = 0;
-
 bool linker::PhiCleanerPass::runOnFunction(Function &f) {
   bool changed = false;
 
@@ -81,3 +79,12 @@ bool linker::PhiCleanerPass::runOnFunction(Function &f) {
 
   return changed;
 }
+
+PreservedAnalyses linker::PhiCleanerPass::run(Function &F,
+                                              FunctionAnalysisManager &) {
+  if (!runOnFunction(F))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
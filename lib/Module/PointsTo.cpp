@@ -0,0 +1,563 @@
+//===-- PointsTo.cpp ------------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// An inclusion-based (Andersen-style), field-insensitive points-to analysis
+// over the whole linked module. Its result is attached to the module, so
+// that the Engine can resolve a symbolic pointer against the few allocation
+// sites it may point into rather than against every live object:
+//
+//  - every allocation site (global, alloca, heap allocation call) gets
+//    !fs.site !{i32 <id>},
+//  - every load and store whose pointer may only point into known sites
+//    gets !fs.pts !{i32 <id>, ...}; accesses that may reach memory the
+//    analysis does not see (external code, integers cast to pointers) are
+//    left without it,
+//  - the sites can be written to a side table, one "id,kind,function,name"
+//    line per site.
+//
+// The linked module is taken to be the whole program: external functions only
+// see the memory they are passed, and the arguments of main and of callbacks
+// handed to external functions point to unknown memory.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "points-to"
+
+ALWAYS_ENABLED_STATISTIC(NumSites, "Number of allocation sites");
+ALWAYS_ENABLED_STATISTIC(NumAnnotated,
+                         "Number of loads and stores annotated with fs.pts");
+ALWAYS_ENABLED_STATISTIC(NumUnknown,
+                         "Number of loads and stores that may access unknown "
+                         "memory");
+
+namespace {
+
+const char *const heapAllocators[] = {
+    "malloc",  "calloc", "realloc", "valloc", "memalign", "aligned_alloc",
+    "strdup",  "strndup", "_Znwm",  "_Znam",
+};
+
+// Whether call is an allocation site. Only the allocators the Engine models
+// count; a call to an allocator defined in the module is analyzed like any
+// other call, so the sites inside it flow out through its return.
+bool isHeapAllocation(const CallBase &call) {
+  const Function *callee = call.getCalledFunction();
+  if (!callee || !callee->isDeclaration() || callee->isIntrinsic())
+    return false;
+  if (isNoAliasCall(&call))
+    return true;
+  for (const char *name : heapAllocators)
+    if (callee->getName() == name)
+      return true;
+  return false;
+}
+
+bool mayHoldPointer(Type *T) {
+  if (T->isPointerTy())
+    return true;
+  if (auto *VT = dyn_cast<VectorType>(T))
+    return VT->getElementType()->isPointerTy();
+  if (auto *ST = dyn_cast<StructType>(T))
+    return std::any_of(ST->element_begin(), ST->element_end(),
+                       mayHoldPointer);
+  if (auto *AT = dyn_cast<ArrayType>(T))
+    return mayHoldPointer(AT->getElementType());
+  return false;
+}
+
+class Andersen {
+public:
+  enum ObjectKind { UnknownObject, GlobalObject, StackObject, HeapObject,
+                    FunctionObject };
+
+  struct Object {
+    ObjectKind kind;
+    const Value *value;
+    unsigned content; // Node of the pointers stored in the object
+  };
+
+  std::vector<Object> objects;
+  DenseMap<const Value *, unsigned> objectIds;
+
+  explicit Andersen(Module &M);
+  void solve();
+
+  // Returns the objects V may point to.
+  const SparseBitVector<> &pointsTo(const Value *V) {
+    return pts[getNode(V)];
+  }
+
+private:
+  Module &M;
+
+  std::vector<SparseBitVector<>> pts;
+  std::vector<std::vector<unsigned>> copies;
+  DenseSet<std::pair<unsigned, unsigned>> edges;
+  DenseMap<const Value *, unsigned> nodes;
+  // Complex constraints, keyed by the pointer node they depend on.
+  std::vector<std::vector<unsigned>> loads;  // dst = *node
+  std::vector<std::vector<unsigned>> stores; // *node = src
+  std::vector<std::vector<unsigned>> copiesIn;  // *node = *src
+  std::vector<std::vector<unsigned>> copiesOut; // *dst = *node
+  std::vector<std::vector<const CallBase *>> indirectCalls;
+  std::vector<unsigned> worklist;
+
+  unsigned unknownNode;
+  unsigned unknownObject;
+
+  unsigned createNode() {
+    pts.emplace_back();
+    copies.emplace_back();
+    loads.emplace_back();
+    stores.emplace_back();
+    copiesIn.emplace_back();
+    copiesOut.emplace_back();
+    indirectCalls.emplace_back();
+    return pts.size() - 1;
+  }
+
+  unsigned createObject(ObjectKind kind, const Value *V) {
+    unsigned content = createNode();
+    objects.push_back({kind, V, content});
+    if (V)
+      objectIds[V] = objects.size() - 1;
+    return objects.size() - 1;
+  }
+
+  void addObject(unsigned node, unsigned object) {
+    if (pts[node].test_and_set(object))
+      worklist.push_back(node);
+  }
+
+  void addCopy(unsigned from, unsigned to) {
+    if (from == to || !edges.insert({from, to}).second)
+      return;
+    copies[from].push_back(to);
+    if (pts[to] |= pts[from])
+      worklist.push_back(to);
+  }
+
+  unsigned getNode(const Value *V);
+  void seedConstant(unsigned node, const Constant *C);
+  void addConstraints(Instruction &I);
+  void addCallConstraints(const CallBase &call, const Function &callee);
+  void addExternalCall(const CallBase &call);
+  void addTransfer(const Value *dst, const Value *src);
+  void propagate();
+};
+
+Andersen::Andersen(Module &M) : M(M) {
+  unknownNode = createNode();
+  unknownObject = createObject(UnknownObject, nullptr);
+  // Unknown memory holds unknown pointers, which point to unknown memory.
+  addObject(unknownNode, unknownObject);
+  addCopy(unknownNode, objects[unknownObject].content);
+  addCopy(objects[unknownObject].content, unknownNode);
+
+  for (GlobalVariable &GV : M.globals())
+    createObject(GlobalObject, &GV);
+  for (Function &F : M) {
+    createObject(FunctionObject, &F);
+    for (Instruction &I : instructions(F)) {
+      if (isa<AllocaInst>(I))
+        createObject(StackObject, &I);
+      else if (auto *call = dyn_cast<CallBase>(&I))
+        if (isHeapAllocation(*call))
+          createObject(HeapObject, &I);
+    }
+  }
+
+  for (GlobalVariable &GV : M.globals()) {
+    // Pointers stored by code outside the module cannot be tracked.
+    if (!GV.hasDefinitiveInitializer()) {
+      addCopy(unknownNode, objects[objectIds[&GV]].content);
+      continue;
+    }
+    seedConstant(objects[objectIds[&GV]].content, GV.getInitializer());
+  }
+
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    for (Instruction &I : instructions(F))
+      addConstraints(I);
+  }
+
+  // Pointers the program is started with, and arguments of functions that
+  // external code may call back.
+  SmallPtrSet<const Function *, 16> callbacks;
+  for (Function &F : M)
+    for (Instruction &I : instructions(F))
+      if (auto *call = dyn_cast<CallBase>(&I)) {
+        const Function *callee = call->getCalledFunction();
+        if (callee && callee->isDeclaration() && !callee->isIntrinsic())
+          for (const Value *arg : call->args())
+            if (auto *fn = dyn_cast<Function>(arg->stripPointerCasts()))
+              callbacks.insert(fn);
+      }
+  for (Function &F : M)
+    if (!F.isDeclaration() &&
+        (callbacks.count(&F) || F.getName() == "main"))
+      for (Argument &arg : F.args())
+        if (mayHoldPointer(arg.getType()))
+          addCopy(unknownNode, getNode(&arg));
+}
+
+void Andersen::seedConstant(unsigned node, const Constant *C) {
+  if (isa<ConstantPointerNull>(C) || isa<UndefValue>(C) ||
+      isa<ConstantData>(C))
+    return;
+  if (auto *GV = dyn_cast<GlobalValue>(C)) {
+    if (auto *GA = dyn_cast<GlobalAlias>(GV)) {
+      seedConstant(node, GA->getAliasee());
+      return;
+    }
+    auto it = objectIds.find(GV);
+    if (it != objectIds.end())
+      addObject(node, it->second);
+    else
+      addCopy(unknownNode, node);
+    return;
+  }
+  if (auto *CE = dyn_cast<ConstantExpr>(C)) {
+    if (CE->getOpcode() == Instruction::IntToPtr) {
+      addCopy(unknownNode, node);
+      return;
+    }
+    // Casts, GEPs and selects point to what their pointer operands point to.
+    for (const Use &U : CE->operands())
+      seedConstant(node, cast<Constant>(U.get()));
+    return;
+  }
+  // Aggregates: the node stands for all their elements.
+  for (const Use &U : C->operands())
+    seedConstant(node, cast<Constant>(U.get()));
+}
+
+unsigned Andersen::getNode(const Value *V) {
+  auto it = nodes.find(V);
+  if (it != nodes.end())
+    return it->second;
+  unsigned node = createNode();
+  nodes[V] = node;
+  if (auto *C = dyn_cast<Constant>(V))
+    seedConstant(node, C);
+  else if (isa<InlineAsm>(V) || isa<MetadataAsValue>(V))
+    addCopy(unknownNode, node);
+  return node;
+}
+
+void Andersen::addCallConstraints(const CallBase &call,
+                                  const Function &callee) {
+  if (callee.isDeclaration()) {
+    // The Engine lowers the memory intrinsics to these, and so does the
+    // IntrinsicCleaner.
+    if ((callee.getName() == "memcpy" || callee.getName() == "memmove") &&
+        call.arg_size() == 3) {
+      addTransfer(call.getArgOperand(0), call.getArgOperand(1));
+      if (mayHoldPointer(call.getType()))
+        addCopy(getNode(call.getArgOperand(0)), getNode(&call));
+      return;
+    }
+    addExternalCall(call);
+    return;
+  }
+  for (unsigned i = 0, e = call.arg_size(); i != e; ++i) {
+    const Value *arg = call.getArgOperand(i);
+    if (!mayHoldPointer(arg->getType()))
+      continue;
+    if (i < callee.arg_size())
+      addCopy(getNode(arg), getNode(callee.getArg(i)));
+    else // Variadic arguments are read back through memory we do not track.
+      addCopy(getNode(arg), unknownNode);
+  }
+  if (mayHoldPointer(call.getType()))
+    for (const BasicBlock &BB : callee)
+      if (auto *ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+        if (const Value *value = ret->getReturnValue())
+          addCopy(getNode(value), getNode(&call));
+}
+
+void Andersen::addExternalCall(const CallBase &call) {
+  // External code may read and write pointers through what it is passed,
+  // and may return any of them.
+  for (const Value *arg : call.args()) {
+    if (!mayHoldPointer(arg->getType()))
+      continue;
+    unsigned node = getNode(arg);
+    addCopy(node, unknownNode);
+    stores[node].push_back(unknownNode);
+    loads[node].push_back(unknownNode);
+  }
+  if (mayHoldPointer(call.getType()))
+    addCopy(unknownNode, getNode(&call));
+}
+
+void Andersen::addTransfer(const Value *dst, const Value *src) {
+  unsigned dstNode = getNode(dst);
+  unsigned srcNode = getNode(src);
+  copiesIn[dstNode].push_back(srcNode);
+  copiesOut[srcNode].push_back(dstNode);
+}
+
+void Andersen::addConstraints(Instruction &I) {
+  auto object = objectIds.find(&I);
+  if (object != objectIds.end()) {
+    addObject(getNode(&I), object->second);
+    // The allocator is not looked into, but realloc keeps the contents.
+    auto *call = dyn_cast<CallBase>(&I);
+    const Function *callee = call ? call->getCalledFunction() : nullptr;
+    if (callee && callee->getName() == "realloc" && call->arg_size() == 2)
+      addTransfer(call, call->getArgOperand(0));
+    return;
+  }
+
+  if (auto *load = dyn_cast<LoadInst>(&I)) {
+    if (mayHoldPointer(load->getType()))
+      loads[getNode(load->getPointerOperand())].push_back(getNode(load));
+    return;
+  }
+  if (auto *store = dyn_cast<StoreInst>(&I)) {
+    if (mayHoldPointer(store->getValueOperand()->getType()))
+      stores[getNode(store->getPointerOperand())].push_back(
+          getNode(store->getValueOperand()));
+    return;
+  }
+  if (auto *xchg = dyn_cast<AtomicCmpXchgInst>(&I)) {
+    if (mayHoldPointer(xchg->getNewValOperand()->getType())) {
+      unsigned ptr = getNode(xchg->getPointerOperand());
+      stores[ptr].push_back(getNode(xchg->getNewValOperand()));
+      loads[ptr].push_back(getNode(xchg));
+    }
+    return;
+  }
+  if (auto *rmw = dyn_cast<AtomicRMWInst>(&I)) {
+    if (mayHoldPointer(rmw->getType())) {
+      unsigned ptr = getNode(rmw->getPointerOperand());
+      stores[ptr].push_back(getNode(rmw->getValOperand()));
+      loads[ptr].push_back(getNode(rmw));
+    }
+    return;
+  }
+
+  if (auto *transfer = dyn_cast<MemTransferInst>(&I)) {
+    addTransfer(transfer->getRawDest(), transfer->getRawSource());
+    return;
+  }
+  if (auto *call = dyn_cast<CallBase>(&I)) {
+    if (isa<IntrinsicInst>(call)) {
+      if (mayHoldPointer(call->getType()))
+        addCopy(unknownNode, getNode(call));
+      // va_start and va_copy fill the va_list with pointers the analysis
+      // does not see, and so may any other intrinsic writing through its
+      // arguments.
+      if (!call->onlyReadsMemory() && !isa<MemSetInst>(call) &&
+          !call->isLifetimeStartOrEnd())
+        for (const Value *arg : call->args())
+          if (mayHoldPointer(arg->getType()))
+            stores[getNode(arg)].push_back(unknownNode);
+      return;
+    }
+    if (const Function *callee = call->getCalledFunction()) {
+      addCallConstraints(*call, *callee);
+      return;
+    }
+    if (call->isInlineAsm()) {
+      addExternalCall(*call);
+      return;
+    }
+    indirectCalls[getNode(call->getCalledOperand())].push_back(call);
+    return;
+  }
+
+  if (!mayHoldPointer(I.getType())) {
+    // A pointer converted to an integer may come back from anywhere.
+    if (isa<PtrToIntInst>(I))
+      addCopy(getNode(I.getOperand(0)), unknownNode);
+    return;
+  }
+  if (isa<IntToPtrInst>(I) || isa<VAArgInst>(I)) {
+    addCopy(unknownNode, getNode(&I));
+    return;
+  }
+
+  // Casts, GEPs, phis, selects, extracts and inserts: the result points to
+  // what the pointer operands point to.
+  unsigned node = getNode(&I);
+  for (const Use &U : I.operands())
+    if (mayHoldPointer(U->getType()) && !isa<BasicBlock>(U.get()))
+      addCopy(getNode(U.get()), node);
+}
+
+void Andersen::solve() {
+  for (unsigned node = 0; node < pts.size(); ++node)
+    if (!pts[node].empty())
+      worklist.push_back(node);
+  propagate();
+
+  // A value that no constraint reaches comes from something the analysis
+  // does not model, so it may point anywhere. Constants pointing nowhere
+  // are null or undef.
+  bool changed;
+  do {
+    changed = false;
+    for (const auto &entry : nodes)
+      if (!isa<Constant>(entry.first) && pts[entry.second].empty()) {
+        addObject(entry.second, unknownObject);
+        changed = true;
+      }
+    propagate();
+  } while (changed);
+}
+
+void Andersen::propagate() {
+  while (!worklist.empty()) {
+    unsigned node = worklist.back();
+    worklist.pop_back();
+
+    for (unsigned object : pts[node]) {
+      unsigned content = objects[object].content;
+      for (unsigned dst : loads[node])
+        addCopy(content, dst);
+      for (unsigned src : stores[node])
+        addCopy(src, content);
+      for (unsigned src : copiesIn[node])
+        for (unsigned srcObject : pts[src])
+          addCopy(objects[srcObject].content, content);
+      for (unsigned dst : copiesOut[node])
+        for (unsigned dstObject : pts[dst])
+          addCopy(content, objects[dstObject].content);
+      if (objects[object].kind == FunctionObject)
+        for (const CallBase *call : indirectCalls[node])
+          addCallConstraints(*call, *cast<Function>(objects[object].value));
+      else if (objects[object].kind == UnknownObject)
+        for (const CallBase *call : indirectCalls[node])
+          addExternalCall(*call);
+    }
+
+    for (unsigned succ : copies[node])
+      if (pts[succ] |= pts[node])
+        worklist.push_back(succ);
+  }
+}
+
+StringRef getKindName(Andersen::ObjectKind kind) {
+  switch (kind) {
+  case Andersen::GlobalObject:
+    return "global";
+  case Andersen::StackObject:
+    return "stack";
+  case Andersen::HeapObject:
+    return "heap";
+  default:
+    return "unknown";
+  }
+}
+
+} // namespace
+
+namespace linker {
+
+bool PointsToPass::runOnModule(Module &M) {
+  Andersen analysis(M);
+  analysis.solve();
+
+  LLVMContext &ctx = M.getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+  unsigned siteKind = ctx.getMDKindID("fs.site");
+  unsigned ptsKind = ctx.getMDKindID("fs.pts");
+
+  // Number the memory objects of the module in module order.
+  std::vector<unsigned> siteIds(analysis.objects.size(), ~0u);
+  std::vector<unsigned> sites;
+  for (unsigned object = 0; object < analysis.objects.size(); ++object) {
+    Andersen::ObjectKind kind = analysis.objects[object].kind;
+    if (kind == Andersen::UnknownObject || kind == Andersen::FunctionObject)
+      continue;
+    siteIds[object] = sites.size();
+    sites.push_back(object);
+  }
+  for (unsigned object : sites) {
+    const Value *V = analysis.objects[object].value;
+    MDNode *id = MDNode::get(
+        ctx, ConstantAsMetadata::get(ConstantInt::get(i32, siteIds[object])));
+    if (auto *GV = dyn_cast<GlobalVariable>(V))
+      const_cast<GlobalVariable *>(GV)->setMetadata(siteKind, id);
+    else
+      const_cast<Instruction *>(cast<Instruction>(V))->setMetadata(siteKind,
+                                                                   id);
+  }
+  NumSites += sites.size();
+
+  for (Function &F : M)
+    for (Instruction &I : instructions(F)) {
+      Value *ptr = getLoadStorePointerOperand(&I);
+      if (!ptr)
+        continue;
+      const SparseBitVector<> &targets = analysis.pointsTo(ptr);
+      SmallVector<Metadata *, 8> ids;
+      bool unknown = targets.empty();
+      for (unsigned object : targets) {
+        if (siteIds[object] == ~0u) {
+          unknown |= analysis.objects[object].kind == Andersen::UnknownObject;
+          continue;
+        }
+        ids.push_back(ConstantAsMetadata::get(
+            ConstantInt::get(i32, siteIds[object])));
+      }
+      if (unknown) {
+        I.setMetadata(ptsKind, nullptr);
+        ++NumUnknown;
+        continue;
+      }
+      I.setMetadata(ptsKind, MDNode::get(ctx, ids));
+      ++NumAnnotated;
+    }
+
+  if (!tableFile.empty()) {
+    std::error_code EC;
+    raw_fd_ostream table(tableFile, EC, sys::fs::OF_Text);
+    if (EC)
+      linker_error("Unable to open '%s': %s", tableFile.c_str(),
+                   EC.message().c_str());
+    for (unsigned object : sites) {
+      const Value *V = analysis.objects[object].value;
+      const auto *I = dyn_cast<Instruction>(V);
+      table << siteIds[object] << ',' << getKindName(analysis.objects[object].kind)
+            << ',' << (I ? I->getFunction()->getName() : "") << ','
+            << V->getName() << '\n';
+    }
+  }
+  return true;
+}
+
+PreservedAnalyses PointsToPass::run(Module &M, ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+} // namespace linker
@@ -0,0 +1,152 @@
+//===-- PostDominators.cpp ------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Writes the FSPD file described in fs-linker/Module/PostDominators.h.
+//
+// Control dependences are computed from the post-dominator tree: for an edge
+// A -> B where B does not strictly post-dominate A, B and its post-dominators
+// up to, but not including, the immediate post-dominator of A are control
+// dependent on A.
+//
+//===----------------------------------------------------------------------===//
+
+#include "fs-linker/Module/PostDominators.h"
+
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+
+struct FunctionData {
+  StringRef name;
+  std::vector<uint32_t> ipdom;
+  std::vector<uint32_t> controlStart;
+  std::vector<uint32_t> controlBlocks;
+};
+
+void computeFunction(Function &F, FunctionData &data) {
+  DenseMap<const BasicBlock *, uint32_t> index;
+  uint32_t numBlocks = 0;
+  for (BasicBlock &BB : F)
+    index[&BB] = numBlocks++;
+  auto getIndex = [&](const DomTreeNode *node) {
+    return node && node->getBlock() ? index.lookup(node->getBlock())
+                                    : linker::fspd::NoBlock;
+  };
+
+  PostDominatorTree PDT(F);
+  std::vector<std::vector<uint32_t>> controls(numBlocks);
+  data.ipdom.reserve(numBlocks);
+  for (BasicBlock &A : F) {
+    DomTreeNode *nodeA = PDT.getNode(&A);
+    DomTreeNode *ipdom = nodeA ? nodeA->getIDom() : nullptr;
+    data.ipdom.push_back(getIndex(ipdom));
+    if (!nodeA)
+      continue;
+    uint32_t indexA = index.lookup(&A);
+    for (BasicBlock *B : successors(&A)) {
+      if (PDT.properlyDominates(B, &A))
+        continue;
+      for (DomTreeNode *runner = PDT.getNode(B);
+           runner && runner != ipdom && runner->getBlock();
+           runner = runner->getIDom())
+        controls[index.lookup(runner->getBlock())].push_back(indexA);
+    }
+  }
+
+  data.controlStart.reserve(numBlocks + 1);
+  for (std::vector<uint32_t> &blocks : controls) {
+    data.controlStart.push_back(data.controlBlocks.size());
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    data.controlBlocks.insert(data.controlBlocks.end(), blocks.begin(),
+                              blocks.end());
+  }
+  data.controlStart.push_back(data.controlBlocks.size());
+}
+
+} // namespace
+
+namespace linker {
+
+void writePostDominators(Module &M, const std::string &path) {
+  std::vector<FunctionData> functions;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    functions.emplace_back();
+    functions.back().name = F.getName();
+    computeFunction(F, functions.back());
+  }
+  std::sort(functions.begin(), functions.end(),
+            [](const FunctionData &a, const FunctionData &b) {
+              return a.name < b.name;
+            });
+
+  // Lay out the file: header, function entries, the arrays of every
+  // function, then the names.
+  std::vector<fspd::FunctionEntry> entries(functions.size());
+  uint64_t offset = sizeof(fspd::Header) +
+                    functions.size() * sizeof(fspd::FunctionEntry);
+  uint64_t nameOffset = 0;
+  for (size_t i = 0; i != functions.size(); ++i) {
+    FunctionData &data = functions[i];
+    fspd::FunctionEntry &entry = entries[i];
+    entry.nameOffset = nameOffset;
+    entry.nameSize = data.name.size();
+    entry.numBlocks = data.ipdom.size();
+    entry.numControlEdges = data.controlBlocks.size();
+    entry.ipdomOffset = offset;
+    offset += data.ipdom.size() * sizeof(uint32_t);
+    entry.controlStartOffset = offset;
+    offset += data.controlStart.size() * sizeof(uint32_t);
+    entry.controlBlocksOffset = offset;
+    offset += data.controlBlocks.size() * sizeof(uint32_t);
+    entry.reserved = 0;
+    nameOffset += data.name.size();
+  }
+  if (offset + nameOffset > UINT32_MAX)
+    linker_error("Post-dominators of the module do not fit in an FSPD file");
+
+  std::error_code EC;
+  raw_fd_ostream file(path, EC, sys::fs::OF_None);
+  if (EC)
+    linker_error("Unable to open '%s': %s", path.c_str(),
+                 EC.message().c_str());
+  support::endian::Writer out(file, support::little);
+
+  file.write(fspd::Magic, sizeof(fspd::Magic));
+  out.write<uint32_t>(fspd::Version);
+  out.write<uint32_t>(functions.size());
+  out.write<uint32_t>(offset);
+  for (const fspd::FunctionEntry &entry : entries)
+    out.write<uint32_t>({entry.nameOffset, entry.nameSize, entry.numBlocks,
+                         entry.numControlEdges, entry.ipdomOffset,
+                         entry.controlStartOffset, entry.controlBlocksOffset,
+                         entry.reserved});
+  for (const FunctionData &data : functions) {
+    out.write<uint32_t>(data.ipdom);
+    out.write<uint32_t>(data.controlStart);
+    out.write<uint32_t>(data.controlBlocks);
+  }
+  for (const FunctionData &data : functions)
+    file << data.name;
+}
+} // namespace linker
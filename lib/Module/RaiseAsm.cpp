@@ -11,6 +11,7 @@
 #include "fs-linker/Config/Version.h"
 #include "fs-linker/Support/Utils.h"
 
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/CodeGen/TargetLowering.h"
 #include "llvm/CodeGen/TargetSubtargetInfo.h"
 #include "llvm/IR/Function.h"
@@ -19,14 +20,481 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/Host.h"
-#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Target/TargetMachine.h"
 
+#include <algorithm>
 
 using namespace llvm;
 using namespace linker;
 
-char RaiseAsmPass::ID = 0;
+namespace {
+
+// Returns the canonical spelling of an asm string: lower case, statements
+// separated by "; ", lock and rep prefixes split off into statements of their
+// own and no blanks between operands. cld is dropped, as the ABI guarantees a
+// clear direction flag anyway.
+std::string normalizeAsm(StringRef asmString) {
+  std::string lowered = asmString.lower();
+  std::replace(lowered.begin(), lowered.end(), '\t', ' ');
+
+  SmallVector<StringRef, 8> statements;
+  SplitString(lowered, statements, "\n;");
+
+  std::string result;
+  auto append = [&result](StringRef statement) {
+    if (!result.empty())
+      result += "; ";
+    result += statement.str();
+  };
+  for (StringRef statement : statements) {
+    statement = statement.trim();
+    for (StringRef prefix : {"lock ", "rep ", "repe ", "repz ", "repne ",
+                             "repnz "}) {
+      if (statement.startswith(prefix)) {
+        append(prefix.trim());
+        statement = statement.drop_front(prefix.size()).trim();
+        break;
+      }
+    }
+    if (statement.empty() || statement == "cld")
+      continue;
+
+    StringRef mnemonic, operands;
+    std::tie(mnemonic, operands) = statement.split(' ');
+    std::string canonical = mnemonic.str();
+    if (!operands.empty()) {
+      canonical += ' ';
+      for (char c : operands)
+        if (c != ' ')
+          canonical += c;
+    }
+    append(canonical);
+  }
+  return result;
+}
+
+// An inline asm call with its operands numbered as $N in the asm string.
+// Raising first collects the values of the register outputs and only touches
+// the call in replace(), so that a pattern can still give up half-way.
+class AsmCall {
+  struct Operand {
+    bool isOutput;
+    bool isIndirect;
+    // Register named by the constraint, or by the output an input is tied to
+    std::string reg;
+    // Argument of inputs and indirect outputs
+    Value *value;
+    // Index into the results for register outputs
+    int result;
+    // Operand of the input tied to an output
+    int tied;
+  };
+
+  CallInst *ci;
+  std::vector<Operand> operands;
+  std::vector<Value *> results;
+
+public:
+  explicit AsmCall(CallInst *ci) : ci(ci) {
+    InlineAsm *ia = cast<InlineAsm>(ci->getCalledOperand());
+    unsigned arg = 0;
+    for (const InlineAsm::ConstraintInfo &info : ia->ParseConstraints()) {
+      if (info.Type == InlineAsm::isClobber)
+        continue;
+      Operand op{info.Type == InlineAsm::isOutput, info.isIndirect, "",
+                 nullptr, -1, -1};
+      if (!info.Codes.empty()) {
+        StringRef code = info.Codes.front();
+        unsigned tied;
+        if (!op.isOutput && !code.getAsInteger(10, tied) &&
+            tied < operands.size()) {
+          op.reg = operands[tied].reg;
+          operands[tied].tied = operands.size();
+        } else {
+          op.reg = code.trim("{}").str();
+        }
+      }
+      if (op.isOutput && !op.isIndirect) {
+        op.result = results.size();
+        results.push_back(nullptr);
+      } else if (arg < ci->arg_size()) {
+        op.value = ci->getArgOperand(arg++);
+      }
+      operands.push_back(op);
+    }
+  }
+
+  CallInst *getCall() const { return ci; }
+  Module &getModule() const { return *ci->getModule(); }
+  unsigned getNumOperands() const { return operands.size(); }
+  unsigned getNumResults() const { return results.size(); }
+
+  bool isMemory(unsigned N) const {
+    return N < operands.size() && operands[N].isIndirect;
+  }
+  bool isRegisterOutput(unsigned N) const {
+    return N < operands.size() && operands[N].result >= 0;
+  }
+
+  // Returns the value read by operand N, which for an output is the value of
+  // the input tied to it.
+  Value *getInput(unsigned N) const {
+    if (N >= operands.size())
+      return nullptr;
+    if (operands[N].result >= 0)
+      return operands[N].tied >= 0 ? operands[operands[N].tied].value
+                                   : nullptr;
+    return operands[N].value;
+  }
+
+  Value *getRegisterInput(StringRef reg) const {
+    for (const Operand &op : operands)
+      if (!op.isOutput && op.reg == reg)
+        return op.value;
+    return nullptr;
+  }
+
+  Type *getResultType(unsigned N) const {
+    Type *type = ci->getType();
+    if (auto *st = dyn_cast<StructType>(type))
+      return st->getElementType(operands[N].result);
+    return type;
+  }
+
+  // Registers of the register outputs, in the order of the operands.
+  std::vector<std::pair<unsigned, StringRef>> getRegisterOutputs() const {
+    std::vector<std::pair<unsigned, StringRef>> outputs;
+    for (unsigned i = 0; i < operands.size(); ++i)
+      if (operands[i].result >= 0)
+        outputs.emplace_back(i, operands[i].reg);
+    return outputs;
+  }
+
+  void setResult(unsigned N, Value *value) {
+    results[operands[N].result] = value;
+  }
+
+  // Replaces the call with the collected results.
+  void replace() {
+    if (results.size() == 1) {
+      ci->replaceAllUsesWith(results.front());
+    } else if (!results.empty()) {
+      IRBuilder<> Builder(ci);
+      Value *aggregate = UndefValue::get(ci->getType());
+      for (unsigned i = 0; i < results.size(); ++i)
+        aggregate = Builder.CreateInsertValue(aggregate, results[i], i);
+      ci->replaceAllUsesWith(aggregate);
+    }
+    ci->eraseFromParent();
+  }
+};
+
+// Casts between the integer and pointer types the operands of string
+// instructions come in.
+Value *castTo(IRBuilder<> &Builder, Value *value, Type *type) {
+  Type *from = value->getType();
+  if (from == type)
+    return value;
+  if (from->isPointerTy() && type->isPointerTy())
+    return Builder.CreatePointerCast(value, type);
+  if (from->isPointerTy())
+    return Builder.CreatePtrToInt(value, type);
+  if (type->isPointerTy())
+    return Builder.CreateIntToPtr(value, type);
+  return Builder.CreateZExtOrTrunc(value, type);
+}
+
+bool isIntOrPtr(const Value *value) {
+  return value && (value->getType()->isIntegerTy() ||
+                   value->getType()->isPointerTy());
+}
+
+// Memory barriers such as mfence or a locked no-op on the stack.
+bool raiseFence(AsmCall &call, unsigned ordering) {
+  if (call.getNumResults())
+    return false;
+  IRBuilder<> Builder(call.getCall());
+  Builder.CreateFence(static_cast<AtomicOrdering>(ordering));
+  call.replace();
+  return true;
+}
+
+// Instructions without an effect the Engine can observe, such as pause.
+bool raiseNop(AsmCall &call, unsigned) {
+  if (call.getNumResults())
+    return false;
+  call.replace();
+  return true;
+}
+
+// The empty asm is used both as a compiler barrier and, with tied operands,
+// to hide a value from the optimizer.
+bool raiseEmpty(AsmCall &call, unsigned) {
+  if (!call.getNumResults()) {
+    if (!call.getCall()->getType()->isVoidTy())
+      return false;
+    return raiseFence(call,
+                      static_cast<unsigned>(AtomicOrdering::SequentiallyConsistent));
+  }
+  for (const auto &output : call.getRegisterOutputs()) {
+    Value *input = call.getInput(output.first);
+    if (!input || input->getType() != call.getResultType(output.first))
+      return false;
+    call.setResult(output.first, input);
+  }
+  call.replace();
+  return true;
+}
+
+bool raiseByteSwap(AsmCall &call, unsigned) {
+  if (call.getNumResults() != 1 || !call.isRegisterOutput(0))
+    return false;
+  Value *input = call.getInput(0);
+  if (!input || !input->getType()->isIntegerTy() ||
+      input->getType()->getIntegerBitWidth() % 16 != 0 ||
+      input->getType() != call.getResultType(0))
+    return false;
+  IRBuilder<> Builder(call.getCall());
+  call.setResult(0, Builder.CreateUnaryIntrinsic(Intrinsic::bswap, input));
+  call.replace();
+  return true;
+}
+
+// rdtsc returns the counter either as one 64 bit value in edx:eax or as two
+// 32 bit halves.
+bool raiseReadCycleCounter(AsmCall &call, unsigned) {
+  auto outputs = call.getRegisterOutputs();
+  LLVMContext &ctx = call.getCall()->getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+  if (outputs.size() == 1) {
+    if (!call.getResultType(outputs[0].first)->isIntegerTy(64))
+      return false;
+  } else if (outputs.size() == 2) {
+    for (const auto &output : outputs)
+      if ((output.second != "ax" && output.second != "dx") ||
+          call.getResultType(output.first) != i32)
+        return false;
+  } else {
+    return false;
+  }
+
+  IRBuilder<> Builder(call.getCall());
+  Value *counter = Builder.CreateIntrinsic(Intrinsic::readcyclecounter, {}, {});
+  if (outputs.size() == 1) {
+    call.setResult(outputs[0].first, counter);
+  } else {
+    for (const auto &output : outputs) {
+      Value *half = output.second == "ax"
+                        ? counter
+                        : Builder.CreateLShr(counter, 32);
+      call.setResult(output.first, Builder.CreateTrunc(half, i32));
+    }
+  }
+  call.replace();
+  return true;
+}
+
+// cpuid reports no leaves and no features, which sends the program down its
+// generic code paths.
+bool raiseCpuid(AsmCall &call, unsigned) {
+  auto outputs = call.getRegisterOutputs();
+  if (outputs.empty())
+    return false;
+  for (const auto &output : outputs)
+    if (!call.getResultType(output.first)->isIntegerTy())
+      return false;
+  for (const auto &output : outputs)
+    call.setResult(output.first,
+                   Constant::getNullValue(call.getResultType(output.first)));
+  call.replace();
+  return true;
+}
+
+// xchg and lock xadd between a register and memory, as used for spin locks
+// and atomic counters.
+bool raiseAtomicRMW(AsmCall &call, unsigned operation) {
+  if (call.getNumResults() != 1 || call.getNumOperands() < 2)
+    return false;
+  unsigned reg = call.isMemory(0) ? 1 : 0;
+  unsigned mem = 1 - reg;
+  Value *value = call.getInput(reg);
+  Value *ptr = call.getInput(mem);
+  if (!call.isRegisterOutput(reg) || !call.isMemory(mem) || !value || !ptr ||
+      !value->getType()->isIntegerTy() || !ptr->getType()->isPointerTy() ||
+      value->getType() != call.getResultType(reg))
+    return false;
+
+  IRBuilder<> Builder(call.getCall());
+  ptr = Builder.CreatePointerCast(
+      ptr, value->getType()->getPointerTo(
+               ptr->getType()->getPointerAddressSpace()));
+  Value *old = Builder.CreateAtomicRMW(
+      static_cast<AtomicRMWInst::BinOp>(operation), ptr, value, MaybeAlign(),
+      AtomicOrdering::SequentiallyConsistent);
+  call.setResult(reg, old);
+  call.replace();
+  return true;
+}
+
+// Sets the outputs of rep movs and rep stos: the count register ends up zero
+// and the index registers point past the processed bytes.
+bool setStringResults(AsmCall &call, IRBuilder<> &Builder, Value *bytes,
+                      Value *dst, Value *src) {
+  Type *i8 = Builder.getInt8Ty();
+  for (const auto &output : call.getRegisterOutputs()) {
+    Type *type = call.getResultType(output.first);
+    Value *base = output.second == "di"   ? dst
+                  : output.second == "si" ? src
+                                          : nullptr;
+    if (output.second == "cx") {
+      call.setResult(output.first, Constant::getNullValue(type));
+    } else if (base) {
+      Value *end = Builder.CreateGEP(
+          i8, castTo(Builder, base, Builder.getInt8PtrTy()), bytes);
+      call.setResult(output.first, castTo(Builder, end, type));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool hasStringOutputsOnly(const AsmCall &call) {
+  for (const auto &output : call.getRegisterOutputs())
+    if (output.second != "cx" && output.second != "di" &&
+        output.second != "si")
+      return false;
+  return true;
+}
+
+bool raiseRepMovs(AsmCall &call, unsigned size) {
+  Value *count = call.getRegisterInput("cx");
+  Value *dst = call.getRegisterInput("di");
+  Value *src = call.getRegisterInput("si");
+  if (!count || !count->getType()->isIntegerTy() || !isIntOrPtr(dst) ||
+      !isIntOrPtr(src) || !hasStringOutputsOnly(call))
+    return false;
+
+  IRBuilder<> Builder(call.getCall());
+  const DataLayout &DL = call.getModule().getDataLayout();
+  Type *intPtr = DL.getIntPtrType(call.getCall()->getContext());
+  Value *bytes = Builder.CreateMul(Builder.CreateZExtOrTrunc(count, intPtr),
+                                   ConstantInt::get(intPtr, size));
+  Builder.CreateMemCpy(castTo(Builder, dst, Builder.getInt8PtrTy()),
+                       MaybeAlign(),
+                       castTo(Builder, src, Builder.getInt8PtrTy()),
+                       MaybeAlign(), bytes);
+  setStringResults(call, Builder, bytes, dst, src);
+  call.replace();
+  return true;
+}
+
+// rep stos with an element wider than a byte can only be expressed as a
+// memset if all bytes of the stored value are equal.
+bool raiseRepStos(AsmCall &call, unsigned size) {
+  Value *count = call.getRegisterInput("cx");
+  Value *dst = call.getRegisterInput("di");
+  Value *value = call.getRegisterInput("ax");
+  if (!count || !count->getType()->isIntegerTy() || !isIntOrPtr(dst) ||
+      !value || !value->getType()->isIntegerTy() ||
+      value->getType()->getIntegerBitWidth() < size * 8 ||
+      !hasStringOutputsOnly(call))
+    return false;
+  for (const auto &output : call.getRegisterOutputs())
+    if (output.second == "si")
+      return false;
+
+  Constant *byte = nullptr;
+  if (size != 1) {
+    auto *c = dyn_cast<ConstantInt>(value);
+    if (!c)
+      return false;
+    APInt element = c->getValue().trunc(size * 8);
+    if (!element.isSplat(8))
+      return false;
+    byte = ConstantInt::get(call.getCall()->getContext(), element.trunc(8));
+  }
+
+  IRBuilder<> Builder(call.getCall());
+  const DataLayout &DL = call.getModule().getDataLayout();
+  Type *intPtr = DL.getIntPtrType(call.getCall()->getContext());
+  Value *bytes = Builder.CreateMul(Builder.CreateZExtOrTrunc(count, intPtr),
+                                   ConstantInt::get(intPtr, size));
+  Value *fill = byte ? byte : Builder.CreateTrunc(value, Builder.getInt8Ty());
+  Builder.CreateMemSet(castTo(Builder, dst, Builder.getInt8PtrTy()), fill,
+                       bytes, MaybeAlign());
+  setStringResults(call, Builder, bytes, dst, nullptr);
+  call.replace();
+  return true;
+}
+
+struct AsmPattern {
+  // Asm string as returned by normalizeAsm
+  const char *asmString;
+  bool (*raise)(AsmCall &call, unsigned arg);
+  unsigned arg;
+};
+
+const unsigned SeqCst =
+    static_cast<unsigned>(AtomicOrdering::SequentiallyConsistent);
+
+// Inline asm found in glibc, uClibc and the programs linked against them.
+const AsmPattern X86Patterns[] = {
+    {"", raiseEmpty, 0},
+
+    {"mfence", raiseFence, SeqCst},
+    {"lfence", raiseFence, static_cast<unsigned>(AtomicOrdering::Acquire)},
+    {"sfence", raiseFence, static_cast<unsigned>(AtomicOrdering::Release)},
+    {"lock; orl $$0,(%esp)", raiseFence, SeqCst},
+    {"lock; orl $$0,0(%esp)", raiseFence, SeqCst},
+    {"lock; addl $$0,(%esp)", raiseFence, SeqCst},
+    {"lock; addl $$0,0(%esp)", raiseFence, SeqCst},
+    {"lock; orl $$0,(%rsp)", raiseFence, SeqCst},
+    {"lock; orl $$0,0(%rsp)", raiseFence, SeqCst},
+    {"lock; orq $$0,(%rsp)", raiseFence, SeqCst},
+    {"lock; orq $$0,0(%rsp)", raiseFence, SeqCst},
+    {"lock; addl $$0,(%rsp)", raiseFence, SeqCst},
+    {"lock; addl $$0,0(%rsp)", raiseFence, SeqCst},
+    {"lock; addl $$0,-4(%rsp)", raiseFence, SeqCst},
+
+    {"pause", raiseNop, 0},
+    {"rep; nop", raiseNop, 0},
+    {"nop", raiseNop, 0},
+
+    {"bswap $0", raiseByteSwap, 0},
+    {"bswapl $0", raiseByteSwap, 0},
+    {"bswapq $0", raiseByteSwap, 0},
+
+    {"rdtsc", raiseReadCycleCounter, 0},
+
+    {"cpuid", raiseCpuid, 0},
+    {"xchgl %ebx,$1; cpuid; xchgl %ebx,$1", raiseCpuid, 0},
+    {"xchgq %rbx,${1:q}; cpuid; xchgq %rbx,${1:q}", raiseCpuid, 0},
+
+    {"xchg $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"xchgb $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"xchgw $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"xchgl $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"xchgq $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"lock; xchg $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"lock; xchgl $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"lock; xchgq $0,$1", raiseAtomicRMW, AtomicRMWInst::Xchg},
+    {"lock; xadd $0,$1", raiseAtomicRMW, AtomicRMWInst::Add},
+    {"lock; xaddb $0,$1", raiseAtomicRMW, AtomicRMWInst::Add},
+    {"lock; xaddw $0,$1", raiseAtomicRMW, AtomicRMWInst::Add},
+    {"lock; xaddl $0,$1", raiseAtomicRMW, AtomicRMWInst::Add},
+    {"lock; xaddq $0,$1", raiseAtomicRMW, AtomicRMWInst::Add},
+
+    {"rep; movsb", raiseRepMovs, 1},
+    {"rep; movsw", raiseRepMovs, 2},
+    {"rep; movsl", raiseRepMovs, 4},
+    {"rep; movsq", raiseRepMovs, 8},
+    {"rep; stosb", raiseRepStos, 1},
+    {"rep; stosw", raiseRepStos, 2},
+    {"rep; stosl", raiseRepStos, 4},
+    {"rep; stosq", raiseRepStos, 8},
+};
+} // namespace
 
 Function *RaiseAsmPass::getIntrinsic(llvm::Module &M, unsigned IID, Type **Tys,
                                      unsigned NumTys) {
@@ -34,8 +502,6 @@ Function *RaiseAsmPass::getIntrinsic(llvm::Module &M, unsigned IID, Type **Tys,
                                    llvm::ArrayRef<llvm::Type*>(Tys, NumTys));
 }
 
-// FIXME: This should just be implemented as a patch to
-// X86TargetAsmInfo.cpp, then everyone will benefit.
 bool RaiseAsmPass::runOnInstruction(Module &M, Instruction *I) {
   // We can just raise inline assembler using calls
   CallInst *ci = dyn_cast<CallInst>(I);
@@ -51,51 +517,46 @@ bool RaiseAsmPass::runOnInstruction(Module &M, Instruction *I) {
     return false;
 
   // Try to use existing infrastructure
-  if (!TLI)
-    return false;
-
-  if (TLI->ExpandInlineAsm(ci))
+  if (TLI && TLI->ExpandInlineAsm(ci))
     return true;
 
   if ((triple.getArch() == llvm::Triple::x86 ||
        triple.getArch() == llvm::Triple::x86_64) &&
       (triple.isOSLinux() || triple.isMacOSX() || triple.isOSFreeBSD())) {
-
-    if (ia->getAsmString() == "" && ia->hasSideEffects() &&
-        ia->getFunctionType()->getReturnType()->isVoidTy()) {
-      IRBuilder<> Builder(I);
-      Builder.CreateFence(llvm::AtomicOrdering::SequentiallyConsistent);
-      I->eraseFromParent();
-      return true;
+    std::string asmString = normalizeAsm(ia->getAsmString());
+    for (const AsmPattern &pattern : X86Patterns) {
+      if (asmString != pattern.asmString)
+        continue;
+      AsmCall call(ci);
+      if (pattern.raise(call, pattern.arg))
+        return true;
     }
   }
 
+  linker_message_once(ia, "unable to raise inline asm \"%s\" (%s) in %s",
+                      ia->getAsmString().c_str(),
+                      ia->getConstraintString().c_str(),
+                      ci->getFunction()->getName().str().c_str());
   return false;
 }
 
 bool RaiseAsmPass::runOnModule(Module &M) {
   bool changed = false;
-  std::string Err;
-
-  // Use target triple from the module if possible.
-  std::string TargetTriple = M.getTargetTriple();
-  if (TargetTriple.empty())
-    TargetTriple = llvm::sys::getDefaultTargetTriple();
-  const Target *Target = TargetRegistry::lookupTarget(TargetTriple, Err);
-
-  TargetMachine * TM = 0;
-  if (Target == 0) {
-    linker_message("Warning: unable to select target: %s", Err.c_str());
-    TLI = 0;
-  } else {
-    TM = Target->createTargetMachine(TargetTriple, "", "", TargetOptions(),
-                                     None);
-    TLI = TM->getSubtargetImpl(*(M.begin()))->getTargetLowering();
 
+  // Use target triple from the module if there is no target.
+  if (TM) {
+    triple = TM->getTargetTriple();
+  } else {
+    std::string TargetTriple = M.getTargetTriple();
+    if (TargetTriple.empty())
+      TargetTriple = llvm::sys::getDefaultTargetTriple();
     triple = llvm::Triple(TargetTriple);
   }
 
   for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+    if (fi->isDeclaration())
+      continue;
+    TLI = TM ? TM->getSubtargetImpl(*fi)->getTargetLowering() : nullptr;
     for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
       for (BasicBlock::iterator ii = bi->begin(), ie = bi->end(); ii != ie;) {
         Instruction *i = &*ii;
@@ -105,7 +566,13 @@ bool RaiseAsmPass::runOnModule(Module &M) {
     }
   }
 
-  delete TM;
-
   return changed;
 }
+
+PreservedAnalyses RaiseAsmPass::run(Module &M, ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
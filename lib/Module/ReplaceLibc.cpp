@@ -0,0 +1,184 @@
+//===-- ReplaceLibc.cpp ---------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Redirects the calls of libc string and memory routines to the versions of
+// the string runtime library (runtime/Strings), which are defined as
+// __fs_<name>. The memcpy, memmove and memset intrinsics are redirected as
+// well, since the Engine would lower them to calls of the libc routines.
+//
+// The library marks its routines used so that they are always linked in.
+// Once calls are redirected, the routines nobody calls are removed again.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "replace-libc"
+
+ALWAYS_ENABLED_STATISTIC(NumRedirectedCalls,
+                         "Number of libc calls redirected to the "
+                         "string runtime");
+
+namespace {
+
+const char *const RuntimePrefix = "__fs_";
+
+bool isRuntimeFunction(const Function *F) {
+  return F && F->getName().startswith(RuntimePrefix);
+}
+
+// Returns the libc routine that replaces the memory intrinsic I.
+StringRef getLibcName(const MemIntrinsic &I) {
+  switch (I.getIntrinsicID()) {
+  case Intrinsic::memcpy:
+    return "memcpy";
+  case Intrinsic::memmove:
+    return "memmove";
+  case Intrinsic::memset:
+    return "memset";
+  default:
+    return "";
+  }
+}
+
+// Replaces the memory intrinsic I with a call of Replacement.
+void replaceIntrinsic(MemIntrinsic &I, Function &Replacement) {
+  FunctionType *FTy = Replacement.getFunctionType();
+  IRBuilder<> Builder(&I);
+  SmallVector<Value *, 3> args;
+  args.push_back(
+      Builder.CreatePointerCast(I.getRawDest(), FTy->getParamType(0)));
+  if (auto *transfer = dyn_cast<MemTransferInst>(&I))
+    args.push_back(Builder.CreatePointerCast(transfer->getRawSource(),
+                                             FTy->getParamType(1)));
+  else
+    args.push_back(Builder.CreateIntCast(cast<MemSetInst>(I).getValue(),
+                                         FTy->getParamType(1), false));
+  args.push_back(Builder.CreateIntCast(I.getLength(), FTy->getParamType(2),
+                                       false));
+  Builder.CreateCall(FTy, &Replacement, args);
+  I.eraseFromParent();
+}
+
+// Drops the runtime functions that are unused apart from llvm.used. Returns
+// true if any was dropped.
+bool removeUnusedRuntime(Module &M) {
+  GlobalVariable *used = M.getGlobalVariable("llvm.used");
+  if (!used || !used->hasInitializer())
+    return false;
+  auto *list = dyn_cast<ConstantArray>(used->getInitializer());
+  if (!list)
+    return false;
+
+  SmallVector<Constant *, 16> kept;
+  SmallVector<Function *, 16> unused;
+  for (Use &U : list->operands()) {
+    auto *element = cast<Constant>(U.get());
+    auto *F = dyn_cast<Function>(element->stripPointerCasts());
+    if (isRuntimeFunction(F) && F->hasOneUse() && element->hasOneUse()) {
+      unused.push_back(F);
+      continue;
+    }
+    kept.push_back(element);
+  }
+  if (unused.empty())
+    return false;
+
+  used->setInitializer(nullptr);
+  if (kept.empty()) {
+    used->eraseFromParent();
+  } else {
+    auto *type = ArrayType::get(list->getType()->getElementType(), kept.size());
+    auto *newUsed = new GlobalVariable(M, type, false, used->getLinkage(),
+                                       ConstantArray::get(type, kept), "",
+                                       used);
+    newUsed->setSection(used->getSection());
+    newUsed->takeName(used);
+    used->eraseFromParent();
+  }
+  list->destroyConstant();
+  for (Function *F : unused) {
+    F->removeDeadConstantUsers();
+    if (F->use_empty())
+      F->eraseFromParent();
+  }
+  return true;
+}
+
+} // namespace
+
+namespace linker {
+
+bool ReplaceLibcPass::runOnModule(Module &M) {
+  StringSet<> selected;
+  for (const std::string &name : functions)
+    selected.insert(name);
+
+  StringMap<Function *> replacements;
+  for (Function &F : M)
+    if (isRuntimeFunction(&F) && !F.isDeclaration()) {
+      StringRef name = F.getName().drop_front(strlen(RuntimePrefix));
+      if (selected.empty() || selected.count(name))
+        replacements[name] = &F;
+    }
+
+  bool changed = false;
+  // Calls inside the runtime itself stay as they are.
+  auto outsideRuntime = [](Use &U) {
+    auto *I = dyn_cast<Instruction>(U.getUser());
+    return !I || !isRuntimeFunction(I->getFunction());
+  };
+  for (auto &entry : replacements) {
+    Function *original = M.getFunction(entry.getKey());
+    if (!original)
+      continue;
+    Function *replacement = entry.getValue();
+    unsigned uses = original->getNumUses();
+    original->replaceUsesWithIf(
+        ConstantExpr::getBitCast(replacement, original->getType()),
+        outsideRuntime);
+    NumRedirectedCalls += uses - original->getNumUses();
+    changed |= uses != original->getNumUses();
+  }
+
+  std::vector<MemIntrinsic *> intrinsics;
+  for (Function &F : M) {
+    if (isRuntimeFunction(&F))
+      continue;
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (auto *memIntrinsic = dyn_cast<MemIntrinsic>(&I))
+          if (!memIntrinsic->isVolatile() &&
+              replacements.count(getLibcName(*memIntrinsic)))
+            intrinsics.push_back(memIntrinsic);
+  }
+  for (MemIntrinsic *I : intrinsics)
+    replaceIntrinsic(*I, *replacements[getLibcName(*I)]);
+  NumRedirectedCalls += intrinsics.size();
+  changed |= !intrinsics.empty();
+
+  // Runtime functions may call each other.
+  while (removeUnusedRuntime(M))
+    changed = true;
+  return changed;
+}
+
+PreservedAnalyses ReplaceLibcPass::run(Module &M, ModuleAnalysisManager &) {
+  if (!runOnModule(M))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+} // namespace linker
@@ -0,0 +1,254 @@
+//===-- SelectiveScalarizer.cpp -------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Splits the vector instructions the Engine cannot execute into one scalar
+// instruction per lane. Vector loads, stores and element-wise integer
+// operations stay as they are, which keeps auto-vectorized code several times
+// smaller than after the full Scalarizer.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+namespace {
+
+bool involvesVectors(const Instruction &I) {
+  if (I.getType()->isVectorTy())
+    return true;
+  for (const Value *op : I.operands())
+    if (op->getType()->isVectorTy())
+      return true;
+  return false;
+}
+
+class LaneSplitter {
+  // Lanes of the vectors that have been taken apart. Lanes are extracted once
+  // right after the vector is defined, and the lanes of a scalarized
+  // instruction are read directly instead of being extracted again.
+  DenseMap<Value *, SmallVector<Value *, 8>> lanes;
+  std::vector<WeakTrackingVH> extracted;
+  std::vector<WeakTrackingVH> rebuilt;
+
+  Value *getLane(IRBuilder<> &Builder, Value *V, unsigned lane) {
+    if (!V->getType()->isVectorTy())
+      return V;
+    // The result of an invoke is only available on its normal edge, which
+    // may join other edges, so it is extracted where it is used.
+    if (isa<Constant>(V) || isa<InvokeInst>(V))
+      return Builder.CreateExtractElement(V, Builder.getInt32(lane));
+    auto it = lanes.find(V);
+    if (it == lanes.end())
+      it = lanes.insert({V, extractLanes(V)}).first;
+    return it->second[lane];
+  }
+
+  SmallVector<Value *, 8> extractLanes(Value *V) {
+    Instruction *insertPt;
+    if (auto *I = dyn_cast<Instruction>(V))
+      insertPt = isa<PHINode>(I) ? &*I->getParent()->getFirstInsertionPt()
+                                 : I->getNextNode();
+    else
+      insertPt = &*cast<Argument>(V)
+                       ->getParent()
+                       ->getEntryBlock()
+                       .getFirstInsertionPt();
+    IRBuilder<> Builder(insertPt);
+    SmallVector<Value *, 8> result;
+    unsigned width = cast<FixedVectorType>(V->getType())->getNumElements();
+    for (unsigned lane = 0; lane < width; ++lane) {
+      Value *scalar = Builder.CreateExtractElement(
+          V, Builder.getInt32(lane), V->getName() + ".i" + Twine(lane));
+      extracted.push_back(scalar);
+      result.push_back(scalar);
+    }
+    return result;
+  }
+
+  Value *createLane(IRBuilder<> &Builder, Instruction &I, unsigned lane) {
+    auto op = [&](unsigned N) {
+      return getLane(Builder, I.getOperand(N), lane);
+    };
+    Type *scalarType = I.getType()->getScalarType();
+
+    if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
+      Value *lhs = op(0), *rhs = op(1);
+      Value *V = Builder.CreateBinOp(BO->getOpcode(), lhs, rhs);
+      if (auto *scalar = dyn_cast<Instruction>(V))
+        scalar->copyIRFlags(BO);
+      return V;
+    }
+    if (auto *UO = dyn_cast<UnaryOperator>(&I)) {
+      Value *V = Builder.CreateUnOp(UO->getOpcode(), op(0));
+      if (auto *scalar = dyn_cast<Instruction>(V))
+        scalar->copyIRFlags(UO);
+      return V;
+    }
+    if (auto *CI = dyn_cast<CmpInst>(&I)) {
+      Value *lhs = op(0), *rhs = op(1);
+      return Builder.CreateCmp(CI->getPredicate(), lhs, rhs);
+    }
+    if (auto *CI = dyn_cast<CastInst>(&I))
+      return Builder.CreateCast(CI->getOpcode(), op(0), scalarType);
+    if (isa<SelectInst>(&I)) {
+      Value *cond = op(0), *trueValue = op(1), *falseValue = op(2);
+      return Builder.CreateSelect(cond, trueValue, falseValue);
+    }
+    if (auto *GEP = dyn_cast<GetElementPtrInst>(&I)) {
+      Value *ptr = op(0);
+      SmallVector<Value *, 4> indices;
+      for (unsigned i = 1; i < GEP->getNumOperands(); ++i)
+        indices.push_back(op(i));
+      if (GEP->isInBounds())
+        return Builder.CreateInBoundsGEP(GEP->getSourceElementType(), ptr,
+                                         indices);
+      return Builder.CreateGEP(GEP->getSourceElementType(), ptr, indices);
+    }
+    if (auto *SV = dyn_cast<ShuffleVectorInst>(&I)) {
+      int element = SV->getMaskValue(lane);
+      if (element < 0)
+        return UndefValue::get(scalarType);
+      unsigned width =
+          cast<FixedVectorType>(SV->getOperand(0)->getType())->getNumElements();
+      if ((unsigned)element < width)
+        return getLane(Builder, SV->getOperand(0), element);
+      return getLane(Builder, SV->getOperand(1), element - width);
+    }
+    llvm_unreachable("instruction cannot be split into lanes");
+  }
+
+public:
+  static bool canSplit(const Instruction &I) {
+    if (!isa<FixedVectorType>(I.getType()))
+      return false;
+    for (const Value *op : I.operands())
+      if (op->getType()->isVectorTy() && !isa<FixedVectorType>(op->getType()))
+        return false;
+    return isa<BinaryOperator>(I) || isa<UnaryOperator>(I) ||
+           isa<CmpInst>(I) || isa<CastInst>(I) || isa<SelectInst>(I) ||
+           isa<GetElementPtrInst>(I) || isa<ShuffleVectorInst>(I);
+  }
+
+  // Replaces I by its lanes put back together into a vector.
+  void split(Instruction &I) {
+    IRBuilder<> Builder(&I);
+    auto *type = cast<FixedVectorType>(I.getType());
+    SmallVector<Value *, 8> scalars;
+    Value *vector = UndefValue::get(type);
+    for (unsigned lane = 0; lane < type->getNumElements(); ++lane) {
+      Value *scalar = createLane(Builder, I, lane);
+      scalars.push_back(scalar);
+      vector = Builder.CreateInsertElement(vector, scalar, lane,
+                                           I.getName() + ".i" + Twine(lane));
+    }
+    lanes[vector] = std::move(scalars);
+    I.replaceAllUsesWith(vector);
+    if (isa<Instruction>(vector))
+      vector->takeName(&I);
+    I.eraseFromParent();
+    rebuilt.push_back(vector);
+  }
+
+  // Removes the rebuilt vectors that only had scalarized users and the
+  // lanes nobody reads.
+  void removeDeadVectors() {
+    for (auto it = rebuilt.rbegin(), ie = rebuilt.rend(); it != ie; ++it) {
+      Value *V = *it;
+      if (auto *I = dyn_cast_or_null<Instruction>(V))
+        RecursivelyDeleteTriviallyDeadInstructions(I);
+    }
+    for (Value *V : extracted)
+      if (auto *I = dyn_cast_or_null<Instruction>(V))
+        RecursivelyDeleteTriviallyDeadInstructions(I);
+  }
+};
+} // namespace
+
+namespace linker {
+
+bool SelectiveScalarizerPass::isNativeVectorInstruction(const Instruction &I) {
+  switch (I.getOpcode()) {
+  case Instruction::Load:
+  case Instruction::Store:
+  case Instruction::ExtractElement:
+  case Instruction::InsertElement:
+  case Instruction::PHI:
+    return true;
+  // Element-wise integer arithmetic, logical and shifting
+  case Instruction::Add:
+  case Instruction::Sub:
+  case Instruction::Mul:
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+    return I.getType()->isIntOrIntVectorTy();
+  // Integer comparison and conversion
+  case Instruction::ICmp:
+  case Instruction::Trunc:
+  case Instruction::ZExt:
+  case Instruction::SExt:
+    return I.getOperand(0)->getType()->isIntOrIntVectorTy();
+  // Reinterpreting the bits of a vector without pointers
+  case Instruction::BitCast:
+    return !I.getType()->isPtrOrPtrVectorTy();
+  case Instruction::Select:
+    return !I.getOperand(0)->getType()->isVectorTy();
+  default:
+    return false;
+  }
+}
+
+bool SelectiveScalarizerPass::runOnFunction(Function &F) {
+  auto mustSplit = [&](const Instruction &I) {
+    if (I.isIntDivRem())
+      return splitDivisions;
+    if (I.isShift())
+      return splitShifts;
+    return !isNativeVectorInstruction(I);
+  };
+
+  std::vector<Instruction *> worklist;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      if (involvesVectors(I) && mustSplit(I) && LaneSplitter::canSplit(I))
+        worklist.push_back(&I);
+  if (worklist.empty())
+    return false;
+
+  // Instructions are split in program order, so the lanes of an operand that
+  // has been split already are at hand.
+  LaneSplitter splitter;
+  for (Instruction *I : worklist)
+    splitter.split(*I);
+  splitter.removeDeadVectors();
+  return true;
+}
+
+PreservedAnalyses SelectiveScalarizerPass::run(Function &F,
+                                               FunctionAnalysisManager &) {
+  if (!runOnFunction(F))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+} // namespace linker
@@ -0,0 +1,150 @@
+//===-- SolverCanonicalize.cpp --------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Rewrites arithmetic idioms that are cheap on hardware but expensive for an
+// SMT solver back into the plain operation they implement. Currently this
+// recognizes division by a constant that was expanded into a multiplication
+// by a "magic number" followed by a shift, and the remainder computed from
+// such a quotient.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+namespace {
+
+// Returns the divisor D such that (x * Magic) >> Shift == x / D for every
+// x of NarrowWidth bits, or zero if there is none.
+//
+// The only candidate is D = ceil(2^Shift / Magic), which gives an error
+// e = Magic * D - 2^Shift with 0 <= e < Magic. Writing x = q * D + r, the
+// quotients agree iff r * 2^Shift + x * e < D * 2^Shift. Within the x that
+// share a remainder the largest one is the hardest, and the left side grows
+// with r between wrap-arounds of the largest x, so it suffices to check
+// x = 2^NarrowWidth - 1 and the largest x with r = D - 1.
+uint64_t findMagicDivisor(const APInt &Magic, uint64_t Shift,
+                          unsigned NarrowWidth) {
+  if (Magic.isZero() || NarrowWidth > 64 || Shift > 128)
+    return 0;
+  unsigned Width = std::max<uint64_t>(Shift, Magic.getActiveBits()) +
+                   2 * NarrowWidth + 2;
+  APInt M = Magic.zextOrTrunc(Width);
+  APInt Pow = APInt::getOneBitSet(Width, Shift);
+  APInt D = Pow.udiv(M);
+  if ((D * M).ult(Pow))
+    D += 1;
+  if (D.isZero() || D.getActiveBits() > NarrowWidth)
+    return 0;
+  APInt Error = M * D - Pow;
+
+  auto agrees = [&](const APInt &X) {
+    return (X.urem(D) * Pow + X * Error).ult(D * Pow);
+  };
+  APInt Max = APInt::getLowBitsSet(Width, NarrowWidth);
+  if (!agrees(Max))
+    return 0;
+  APInt Q = Max.udiv(D);
+  if (!Q.isZero() && !agrees(Q * D - 1))
+    return 0;
+  return D.getZExtValue();
+}
+
+// trunc (lshr (mul (zext X), Magic), Shift) -> udiv X, D
+bool simplifyMagicDivision(TruncInst *I) {
+  Value *X;
+  BinaryOperator *Mul;
+  ConstantInt *Magic, *Shift;
+  if (!match(I->getOperand(0),
+             m_LShr(m_CombineAnd(m_c_Mul(m_ZExt(m_Value(X)),
+                                         m_ConstantInt(Magic)),
+                                 m_BinOp(Mul)),
+                    m_ConstantInt(Shift))))
+    return false;
+  if (X->getType() != I->getType())
+    return false;
+
+  // findMagicDivisor reasons about the exact product, so the mul must not
+  // wrap. For i32 x, (zext x to i64) * 2^40 >> 41 is (x >> 1) & 0x7FFFFF,
+  // not x / 2.
+  unsigned NarrowWidth = X->getType()->getIntegerBitWidth();
+  unsigned WideWidth = Mul->getType()->getIntegerBitWidth();
+  if (Shift->getValue().uge(WideWidth) ||
+      (!Mul->hasNoUnsignedWrap() &&
+       Magic->getValue().getActiveBits() + NarrowWidth > WideWidth))
+    return false;
+  uint64_t D = findMagicDivisor(Magic->getValue(), Shift->getZExtValue(),
+                                NarrowWidth);
+  if (!D)
+    return false;
+
+  IRBuilder<> Builder(I);
+  Value *Div = Builder.CreateUDiv(X, ConstantInt::get(X->getType(), D),
+                                  I->getName() + ".udiv");
+  I->replaceAllUsesWith(Div);
+  RecursivelyDeleteTriviallyDeadInstructions(I);
+  return true;
+}
+
+// sub X, (mul (udiv X, D), D) -> urem X, D
+bool simplifyRemainder(BinaryOperator *I) {
+  Value *X;
+  ConstantInt *D, *Factor;
+  if (!match(I, m_Sub(m_Value(X),
+                      m_c_Mul(m_UDiv(m_Deferred(X), m_ConstantInt(D)),
+                              m_ConstantInt(Factor)))) ||
+      D != Factor)
+    return false;
+
+  IRBuilder<> Builder(I);
+  Value *Rem = Builder.CreateURem(X, D, I->getName() + ".urem");
+  I->replaceAllUsesWith(Rem);
+  RecursivelyDeleteTriviallyDeadInstructions(I);
+  return true;
+}
+} // namespace
+
+namespace linker {
+
+bool SolverCanonicalizePass::runOnFunction(Function &F) {
+  bool changed = false;
+  // Quotients are rewritten first so that remainders built from them are
+  // recognized in the second sweep.
+  for (BasicBlock &BB : F)
+    for (auto it = BB.begin(), ie = BB.end(); it != ie;) {
+      Instruction *I = &*it++;
+      if (auto *TI = dyn_cast<TruncInst>(I))
+        changed |= simplifyMagicDivision(TI);
+    }
+
+  for (BasicBlock &BB : F)
+    for (auto it = BB.begin(), ie = BB.end(); it != ie;) {
+      Instruction *I = &*it++;
+      if (I->getOpcode() == Instruction::Sub)
+        changed |= simplifyRemainder(cast<BinaryOperator>(I));
+    }
+
+  return changed;
+}
+
+PreservedAnalyses SolverCanonicalizePass::run(Function &F,
+                                              FunctionAnalysisManager &) {
+  if (!runOnFunction(F))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+} // namespace linker
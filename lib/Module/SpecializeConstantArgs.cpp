@@ -0,0 +1,134 @@
+//===-- SpecializeConstantArgs.cpp ----------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Clones functions for the integer constants they are called with, such as
+// the flags of open(path, O_RDONLY) or fcntl(fd, F_GETFL), and folds the
+// branches on those constants in the clone. The Engine would otherwise fork
+// on flags that were never symbolic.
+//
+// A clone is made for a set of constant arguments that is passed at several
+// call sites, or at a call site in a function marked hot. It keeps the
+// signature of the original, so variadic functions can be specialized too,
+// and it is only kept if folding the constants made it smaller.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Transforms/Scalar/SCCP.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "specialize-constant-args"
+
+ALWAYS_ENABLED_STATISTIC(NumSpecializations,
+                         "Number of functions cloned for constant "
+                         "arguments");
+ALWAYS_ENABLED_STATISTIC(NumSpecializedCalls,
+                         "Number of calls to specialized clones");
+
+namespace {
+
+// The callee of a call and the integer constants it is passed, by argument
+// number.
+typedef std::pair<Function *, std::vector<std::pair<unsigned, ConstantInt *>>>
+    Specialization;
+
+bool isSpecializable(const Function &F) {
+  return !F.isDeclaration() && !F.isInterposable() && !F.hasOptNone() &&
+         !F.isIntrinsic() && !F.hasFnAttribute(Attribute::NoInline);
+}
+
+} // namespace
+
+namespace linker {
+
+bool SpecializeConstantArgsPass::runOnModule(Module &M,
+                                              FunctionAnalysisManager &FAM) {
+  MapVector<Specialization, std::vector<CallBase *>,
+            std::map<Specialization, unsigned>>
+      callSites;
+  for (Function &F : M) {
+    if (F.isDeclaration() || F.hasOptNone())
+      continue;
+    for (Instruction &I : instructions(F)) {
+      auto *call = dyn_cast<CallBase>(&I);
+      if (!call)
+        continue;
+      Function *callee = call->getCalledFunction();
+      if (!callee || callee == &F || !isSpecializable(*callee))
+        continue;
+      Specialization key(callee, {});
+      for (unsigned i = 0, e = callee->arg_size(); i != e; ++i)
+        if (auto *c = dyn_cast<ConstantInt>(call->getArgOperand(i)))
+          key.second.emplace_back(i, c);
+      if (!key.second.empty())
+        callSites[key].push_back(call);
+    }
+  }
+
+  unsigned clones = 0;
+  for (auto &entry : callSites) {
+    if (clones == maxClones)
+      break;
+    Function *callee = entry.first.first;
+    std::vector<CallBase *> &calls = entry.second;
+    bool hot = std::any_of(calls.begin(), calls.end(), [](CallBase *call) {
+      return call->getFunction()->hasFnAttribute(Attribute::Hot);
+    });
+    if (calls.size() < 2 && !hot)
+      continue;
+
+    ValueToValueMapTy VMap;
+    Function *clone = CloneFunction(callee, VMap);
+    clone->setName(callee->getName() + ".fs.spec");
+    clone->setLinkage(GlobalValue::InternalLinkage);
+    clone->setVisibility(GlobalValue::DefaultVisibility);
+    clone->setComdat(nullptr);
+    for (auto &arg : entry.first.second)
+      clone->getArg(arg.first)->replaceAllUsesWith(arg.second);
+
+    // Fold the constants and drop the branches they decide.
+    FunctionPassManager fpm;
+    fpm.addPass(SCCPPass());
+    fpm.addPass(SimplifyCFGPass(getBranchPreservingSimplifyCFGOptions()));
+    fpm.run(*clone, FAM);
+
+    if (clone->getInstructionCount() >= callee->getInstructionCount()) {
+      FAM.clear(*clone, clone->getName());
+      clone->eraseFromParent();
+      continue;
+    }
+
+    for (CallBase *call : calls)
+      call->setCalledFunction(clone);
+    ++clones;
+    ++NumSpecializations;
+    NumSpecializedCalls += calls.size();
+  }
+
+  return clones != 0;
+}
+
+PreservedAnalyses SpecializeConstantArgsPass::run(Module &M,
+                                                  ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  if (!runOnModule(M, FAM))
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+} // namespace linker
@@ -0,0 +1,515 @@
+//===-- StartupEvaluator.cpp ----------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs the part of the program's initialization that does not depend on its
+// input at link time and folds the effects into the global initializers, so
+// that the engine does not interpret it again on every path.
+//
+// Static constructors are evaluated in priority order with LLVM's Evaluator,
+// like GlobalOpt does, until the first one that cannot be evaluated. If all
+// of them could be, the deterministic prefix of __uClibc_init is evaluated as
+// well and the function is rewritten to start where evaluation stopped.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes.h"
+
+#include "fs-linker/Module/ModuleUtil.h"
+#include "fs-linker/Support/Utils.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Evaluator.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+namespace {
+
+// Bounds the instructions of __uClibc_init that are evaluated one by one.
+// Calls count as one step; the Evaluator does not run loops in callees.
+const unsigned MaxEvaluationSteps = 10000;
+
+void replaceCtorList(GlobalVariable *list, ArrayRef<Constant *> entries) {
+  if (entries.empty()) {
+    list->eraseFromParent();
+    return;
+  }
+  ArrayType *ty = ArrayType::get(entries[0]->getType(), entries.size());
+  auto *gv = new GlobalVariable(*list->getParent(), ty, list->isConstant(),
+                                list->getLinkage(),
+                                ConstantArray::get(ty, entries), "", list,
+                                list->getThreadLocalMode());
+  gv->takeName(list);
+  list->eraseFromParent();
+}
+
+// Evaluates the static constructors in the order they run and removes the
+// evaluated ones from llvm.global_ctors. Returns the number of constructors
+// evaluated, remaining is set to the number of those left.
+size_t evaluateConstructors(Module &M, const TargetLibraryInfo &TLI,
+                            size_t &remaining) {
+  remaining = 0;
+  GlobalVariable *ctors = M.getNamedGlobal("llvm.global_ctors");
+  if (!ctors || !ctors->hasInitializer())
+    return 0;
+
+  std::vector<ConstantStruct *> entries = linker::getCtorListByPriority(ctors);
+  size_t done = 0;
+  for (; done < entries.size(); ++done) {
+    Constant *fp = entries[done]->getOperand(1)->stripPointerCasts();
+    if (fp->isNullValue())
+      continue;
+    auto *fn = dyn_cast<Function>(fp);
+    if (!fn || fn->isDeclaration() || fn->arg_size() != 0)
+      break;
+
+    Evaluator eval(M.getDataLayout(), &TLI);
+    Constant *retVal;
+    SmallVector<Constant *, 0> noArgs;
+    if (!eval.EvaluateFunction(fn, retVal, noArgs))
+      break;
+    for (const auto &init : eval.getMutatedInitializers())
+      init.first->setInitializer(init.second);
+    for (GlobalVariable *gv : eval.getInvariants())
+      gv->setConstant(true);
+  }
+
+  remaining = entries.size() - done;
+  if (done) {
+    linker::linker_message("NOTE: evaluated %zu of %zu static constructors "
+                           "at link time",
+                           done, entries.size());
+    replaceCtorList(ctors, std::vector<Constant *>(entries.begin() + done,
+                                                   entries.end()));
+  }
+  return done;
+}
+
+// Adds the globals that the code of F can reach, through the functions and
+// global initializers it refers to, to refs.
+void collectReferencedGlobals(const Function &F,
+                              SmallPtrSetImpl<const GlobalValue *> &refs) {
+  SmallPtrSet<const Constant *, 32> visited;
+  SmallVector<const Value *, 64> worklist;
+  auto visit = [&](const Value *v) {
+    if (auto *c = dyn_cast<Constant>(v))
+      if (visited.insert(c).second)
+        worklist.push_back(c);
+  };
+
+  visit(&F);
+  while (!worklist.empty()) {
+    const Value *v = worklist.pop_back_val();
+    if (auto *fn = dyn_cast<Function>(v)) {
+      refs.insert(fn);
+      for (const BasicBlock &bb : *fn)
+        for (const Instruction &i : bb)
+          for (const Value *op : i.operands())
+            visit(op);
+    } else if (auto *gv = dyn_cast<GlobalVariable>(v)) {
+      refs.insert(gv);
+      if (gv->hasInitializer())
+        visit(gv->getInitializer());
+    } else if (auto *ga = dyn_cast<GlobalAlias>(v)) {
+      refs.insert(ga);
+      visit(ga->getAliasee());
+    } else if (auto *c = dyn_cast<Constant>(v)) {
+      for (const Value *op : c->operands())
+        visit(op);
+    }
+  }
+}
+
+// Adds the globals that ptr may point to to refs. Returns false if ptr may
+// point to a global that cannot be named: pointers read from memory are only
+// accepted if that memory is a local or hangs off an argument, which for the
+// startup code means the engine provided argument and environment strings.
+bool collectPointedToGlobals(const Value *ptr,
+                             SmallPtrSetImpl<const GlobalValue *> &refs,
+                             unsigned depth = 0) {
+  if (depth > 4)
+    return false;
+  SmallVector<const Value *, 4> objects;
+  getUnderlyingObjects(ptr, objects);
+  for (const Value *obj : objects) {
+    if (auto *gv = dyn_cast<GlobalValue>(obj))
+      refs.insert(gv);
+    else if (auto *load = dyn_cast<LoadInst>(obj)) {
+      SmallPtrSet<const GlobalValue *, 4> from;
+      if (!collectPointedToGlobals(load->getPointerOperand(), from, depth + 1) ||
+          !from.empty())
+        return false;
+    } else if (!isa<Argument>(obj) && !isa<AllocaInst>(obj) &&
+               !isa<ConstantPointerNull>(obj) && !isa<UndefValue>(obj))
+      return false;
+  }
+  return true;
+}
+
+// Adds the globals that call may touch before it returns to refs.
+bool collectCallFootprint(const CallBase &call,
+                          SmallPtrSetImpl<const GlobalValue *> &refs) {
+  if (isa<DbgInfoIntrinsic>(call) || call.isLifetimeStartOrEnd())
+    return true;
+  if (auto *mi = dyn_cast<MemIntrinsic>(&call)) {
+    if (!collectPointedToGlobals(mi->getRawDest(), refs))
+      return false;
+    if (auto *mt = dyn_cast<MemTransferInst>(mi))
+      return collectPointedToGlobals(mt->getRawSource(), refs);
+    return true;
+  }
+  const Function *callee = call.getCalledFunction();
+  if (!callee || callee->isDeclaration())
+    return false;
+  collectReferencedGlobals(*callee, refs);
+  for (const Value *arg : call.args())
+    if (arg->getType()->isPointerTy() && !collectPointedToGlobals(arg, refs))
+      return false;
+  return true;
+}
+
+// Adds the globals that the code of call's function may touch before it
+// reaches call to refs.
+bool collectFootprintBefore(const CallBase &call,
+                            SmallPtrSetImpl<const GlobalValue *> &refs) {
+  const BasicBlock *callBB = call.getParent();
+  SmallPtrSet<const BasicBlock *, 16> before;
+  SmallVector<const BasicBlock *, 16> worklist(pred_begin(callBB),
+                                               pred_end(callBB));
+  while (!worklist.empty()) {
+    const BasicBlock *bb = worklist.pop_back_val();
+    if (before.insert(bb).second)
+      worklist.append(pred_begin(bb), pred_end(bb));
+  }
+  // The call is in a loop.
+  if (before.count(callBB))
+    return false;
+
+  auto collect = [&](const Instruction &i) {
+    if (!i.mayReadOrWriteMemory())
+      return true;
+    if (auto *load = dyn_cast<LoadInst>(&i))
+      return collectPointedToGlobals(load->getPointerOperand(), refs);
+    if (auto *store = dyn_cast<StoreInst>(&i))
+      return collectPointedToGlobals(store->getPointerOperand(), refs);
+    if (auto *cb = dyn_cast<CallBase>(&i))
+      return collectCallFootprint(*cb, refs);
+    return false;
+  };
+  for (const BasicBlock *bb : before)
+    for (const Instruction &i : *bb)
+      if (!collect(i))
+        return false;
+  for (const Instruction &i : *callBB) {
+    if (&i == &call)
+      break;
+    if (!collect(i))
+      return false;
+  }
+  return true;
+}
+
+// Returns the only call of F if it is a direct call, or null.
+CallBase *getOnlyCall(Function &F) {
+  if (!F.hasOneUse())
+    return nullptr;
+  auto *call = dyn_cast<CallBase>(F.user_back());
+  if (!call || call->getCalledOperand() != &F)
+    return nullptr;
+  return call;
+}
+
+bool refersOnlyToModule(const Constant *C, const Module &M) {
+  if (auto *gv = dyn_cast<GlobalValue>(C))
+    return gv->getParent() == &M;
+  for (const Value *op : C->operands())
+    if (!refersOnlyToModule(cast<Constant>(op), M))
+      return false;
+  return true;
+}
+
+/// Evaluates a function instruction by instruction, starting at its entry,
+/// until it reaches one that depends on unknown values or memory. Control
+/// flow is followed as long as the conditions are known. Memory accesses
+/// and calls are handed to LLVM's Evaluator one at a time, so that each of
+/// them either completes or has no effect.
+class PrefixEvaluator {
+  Module &M;
+  const TargetLibraryInfo &TLI;
+
+  DenseMap<Value *, Constant *> values;
+  SmallPtrSet<BasicBlock *, 16> executed;
+  // The initializers before the evaluation, to undo it.
+  MapVector<GlobalVariable *, Constant *> original;
+
+  Constant *get(Value *v) const {
+    if (auto *c = dyn_cast<Constant>(v))
+      return c;
+    return values.lookup(v);
+  }
+
+  bool evaluateInstruction(Instruction &I);
+  bool evaluateInStub(Instruction &I, Constant *&result);
+  BasicBlock *getSuccessor(Instruction &term);
+
+public:
+  PrefixEvaluator(Module &M, const TargetLibraryInfo &TLI)
+      : M(M), TLI(TLI) {}
+
+  /// Evaluates F and returns the first instruction that was not evaluated.
+  Instruction *evaluate(Function &F);
+
+  /// Makes F start at resume, which must be the result of evaluate. Returns
+  /// false if that is not possible because the rest of F may come back to
+  /// code that has been evaluated.
+  bool rewrite(Function &F, Instruction *resume);
+
+  /// Restores the global initializers.
+  void undo();
+};
+
+bool PrefixEvaluator::evaluateInStub(Instruction &I, Constant *&result) {
+  LLVMContext &ctx = M.getContext();
+  Instruction *clone = I.clone();
+  for (unsigned i = 0, e = I.getNumOperands(); i != e; ++i) {
+    Constant *c = get(I.getOperand(i));
+    if (!c) {
+      clone->deleteValue();
+      return false;
+    }
+    clone->setOperand(i, c);
+  }
+
+  Function *stub = Function::Create(FunctionType::get(I.getType(), false),
+                                    GlobalValue::InternalLinkage,
+                                    "fs.evaluate.step", &M);
+  BasicBlock *bb = BasicBlock::Create(ctx, "entry", stub);
+  bb->getInstList().push_back(clone);
+  ReturnInst::Create(ctx, I.getType()->isVoidTy() ? nullptr : clone, bb);
+
+  bool evaluated;
+  {
+    Evaluator eval(M.getDataLayout(), &TLI);
+    SmallVector<Constant *, 0> noArgs;
+    evaluated = eval.EvaluateFunction(stub, result, noArgs) &&
+                (!result || refersOnlyToModule(result, M));
+    if (evaluated) {
+      for (const auto &init : eval.getMutatedInitializers()) {
+        original.insert({init.first, init.first->getInitializer()});
+        init.first->setInitializer(init.second);
+      }
+    }
+  }
+  stub->eraseFromParent();
+  return evaluated;
+}
+
+bool PrefixEvaluator::evaluateInstruction(Instruction &I) {
+  if (isa<DbgInfoIntrinsic>(I))
+    return true;
+
+  if (isa<LoadInst>(I) || isa<StoreInst>(I) || isa<CallInst>(I)) {
+    Constant *result = nullptr;
+    if (!evaluateInStub(I, result))
+      return false;
+    if (result)
+      values[&I] = result;
+    return true;
+  }
+
+  if (I.mayReadOrWriteMemory() || I.mayHaveSideEffects() ||
+      isa<AllocaInst>(I) || isa<PHINode>(I) || I.isTerminator())
+    return false;
+
+  SmallVector<Constant *, 4> ops;
+  for (Value *op : I.operands()) {
+    Constant *c = get(op);
+    if (!c)
+      return false;
+    ops.push_back(c);
+  }
+
+  Constant *result;
+  if (auto *cmp = dyn_cast<CmpInst>(&I))
+    result = ConstantFoldCompareInstOperands(cmp->getPredicate(), ops[0],
+                                             ops[1], M.getDataLayout(), &TLI);
+  else
+    result = ConstantFoldInstOperands(&I, ops, M.getDataLayout(), &TLI);
+  if (!result)
+    return false;
+  values[&I] = result;
+  return true;
+}
+
+BasicBlock *PrefixEvaluator::getSuccessor(Instruction &term) {
+  if (auto *br = dyn_cast<BranchInst>(&term)) {
+    if (br->isUnconditional())
+      return br->getSuccessor(0);
+    auto *cond = dyn_cast_or_null<ConstantInt>(get(br->getCondition()));
+    if (!cond)
+      return nullptr;
+    return br->getSuccessor(cond->isZero() ? 1 : 0);
+  }
+  if (auto *sw = dyn_cast<SwitchInst>(&term)) {
+    auto *cond = dyn_cast_or_null<ConstantInt>(get(sw->getCondition()));
+    if (!cond)
+      return nullptr;
+    return sw->findCaseValue(cond)->getCaseSuccessor();
+  }
+  return nullptr;
+}
+
+Instruction *PrefixEvaluator::evaluate(Function &F) {
+  BasicBlock *bb = &F.getEntryBlock();
+  executed.insert(bb);
+  BasicBlock::iterator it = bb->getFirstNonPHI()->getIterator();
+
+  for (unsigned steps = 0; steps != MaxEvaluationSteps; ++steps) {
+    Instruction &I = *it;
+    if (!I.isTerminator()) {
+      if (!evaluateInstruction(I))
+        return &I;
+      ++it;
+      continue;
+    }
+
+    BasicBlock *next = getSuccessor(I);
+    if (!next)
+      return &I;
+    // The PHIs of a block take their values at the same time.
+    SmallVector<std::pair<PHINode *, Constant *>, 4> incoming;
+    for (PHINode &phi : next->phis()) {
+      Constant *c = get(phi.getIncomingValueForBlock(bb));
+      if (!c)
+        return &I;
+      incoming.push_back({&phi, c});
+    }
+    for (const auto &in : incoming)
+      values[in.first] = in.second;
+
+    executed.insert(next);
+    bb = next;
+    it = bb->getFirstNonPHI()->getIterator();
+  }
+  return &*it;
+}
+
+bool PrefixEvaluator::rewrite(Function &F, Instruction *resume) {
+  BasicBlock *bb = resume->getParent();
+  // Nothing has been evaluated.
+  if (bb == &F.getEntryBlock() && resume == bb->getFirstNonPHI())
+    return false;
+
+  // The evaluated values are only valid for code that runs after the
+  // evaluated instructions, so none of them may run again.
+  SmallPtrSet<BasicBlock *, 16> reachable;
+  SmallVector<BasicBlock *, 16> worklist(succ_begin(bb), succ_end(bb));
+  while (!worklist.empty()) {
+    BasicBlock *succ = worklist.pop_back_val();
+    if (executed.count(succ))
+      return false;
+    if (reachable.insert(succ).second)
+      worklist.append(succ_begin(succ), succ_end(succ));
+  }
+
+  BasicBlock *rest = SplitBlock(bb, resume);
+  for (const auto &v : values) {
+    auto *I = dyn_cast<Instruction>(v.first);
+    if (!I)
+      continue;
+    I->replaceUsesWithIf(v.second, [&](Use &U) {
+      return !executed.count(cast<Instruction>(U.getUser())->getParent());
+    });
+  }
+
+  BasicBlock *entry =
+      BasicBlock::Create(M.getContext(), "", &F, &F.getEntryBlock());
+  BranchInst::Create(rest, entry);
+  removeUnreachableBlocks(F);
+  MergeBlockIntoPredecessor(rest);
+  entry->setName("entry");
+  return true;
+}
+
+void PrefixEvaluator::undo() {
+  for (const auto &init : original)
+    init.first->setInitializer(init.second);
+  original.clear();
+}
+
+// Evaluates the deterministic prefix of __uClibc_init. Doing so moves its
+// effects to before the program starts, which is only sound if it is called
+// exactly once, by __uClibc_main, which is called exactly once, by the entry
+// point, and if the code that runs before it cannot observe the difference.
+bool evaluateLibcInit(Module &M, StringRef entryPoint,
+                      const TargetLibraryInfo &TLI) {
+  Function *init = M.getFunction("__uClibc_init");
+  Function *libcMain = M.getFunction("__uClibc_main");
+  Function *entry = M.getFunction(entryPoint);
+  if (!init || init->isDeclaration() || init->arg_size() != 0 || !libcMain ||
+      !entry || !entry->use_empty())
+    return false;
+
+  CallBase *initCall = getOnlyCall(*init);
+  CallBase *mainCall = getOnlyCall(*libcMain);
+  if (!initCall || initCall->getFunction() != libcMain || !mainCall ||
+      mainCall->getFunction() != entry)
+    return false;
+
+  SmallPtrSet<const GlobalValue *, 32> before, touched;
+  if (!collectFootprintBefore(*mainCall, before) ||
+      !collectFootprintBefore(*initCall, before))
+    return false;
+  collectReferencedGlobals(*init, touched);
+  for (const GlobalValue *gv : before)
+    if (touched.count(gv))
+      return false;
+
+  PrefixEvaluator evaluator(M, TLI);
+  Instruction *resume = evaluator.evaluate(*init);
+  if (!evaluator.rewrite(*init, resume)) {
+    evaluator.undo();
+    return false;
+  }
+  if (isa<ReturnInst>(init->getEntryBlock().getFirstNonPHIOrDbg()))
+    linker::linker_message("NOTE: evaluated __uClibc_init at link time");
+  else
+    linker::linker_message("NOTE: evaluated a part of __uClibc_init at link "
+                           "time");
+  return true;
+}
+} // namespace
+
+namespace linker {
+
+bool StartupEvaluatorPass::runOnModule(Module &M) {
+  TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+  TargetLibraryInfo TLI(TLII);
+
+  size_t remaining;
+  bool changed = evaluateConstructors(M, TLI, remaining) != 0;
+
+  // Constructors that are left run before libc is initialized.
+  if (remaining == 0)
+    changed |= evaluateLibcInit(M, entryPoint, TLI);
+  return changed;
+}
+
+PreservedAnalyses StartupEvaluatorPass::run(Module &M,
+                                            ModuleAnalysisManager &) {
+  return runOnModule(M) ? PreservedAnalyses::none()
+                        : PreservedAnalyses::all();
+}
+} // namespace linker
@@ -13,6 +13,8 @@
 #include "fs-linker/Support/Utils.h"
 #include "fs-linker/Module/LinkerModule.h"
 
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
@@ -85,6 +87,26 @@ namespace {
                  cl::cat(StartCat));
 
 
+  /*** Checks options ***/
+
+  cl::OptionCategory ChecksCat("Checks options",
+                               "These options control the checks injected into the code.");
+
+  cl::opt<bool>
+  CheckDivZero("check-div-zero",
+               cl::desc("Inject checks for division-by-zero where the divisor "
+                        "cannot be proven non-zero (default=false)"),
+               cl::init(false),
+               cl::cat(ChecksCat));
+
+  cl::opt<bool>
+  CheckOvershift("check-overshift",
+                 cl::desc("Inject checks for overshift where the shift amount "
+                          "cannot be proven in range (default=false)"),
+                 cl::init(false),
+                 cl::cat(ChecksCat));
+
+
   /*** Linking options ***/
 
   cl::OptionCategory LinkCat("Linking options",
@@ -102,6 +124,25 @@ namespace {
            cl::init(""),
            cl::cat(LinkCat));
 
+  cl::opt<std::string>
+  StringLib("string-lib",
+            cl::desc("Link the given library of string and memory routines "
+                     "written for symbolic execution, or the one built with "
+                     "the linker if no path is given. See --replace-libc."),
+            cl::value_desc("path to the string library"),
+            cl::ValueOptional,
+            cl::cat(LinkCat));
+
+  cl::opt<std::string>
+  PosixConfig("posix-config",
+              cl::desc("Options of the POSIX model (--sym-files, --sym-stdin, "
+                       "--sym-stdout, --save-all-writes, --max-fail, "
+                       "--fd-fail) to apply at link time instead of parsing "
+                       "them from argv on every path"),
+              cl::value_desc("model options"),
+              cl::init(""),
+              cl::cat(LinkCat));
+
   cl::list<std::string>
       LinkLibraries("link-llvm-lib",
                     cl::desc("Link the given bitcode library, "
@@ -214,6 +255,97 @@ static void parseArguments(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv, " linker\n");
 }
 
+// Release builds of LLVM do not track statistics for -stats, and only print
+// a note that they are disabled on exit; -stats-json on its own does nothing.
+// Takes both options over: the counters are tracked from here on and printed
+// at the end of main(). Returns whether either option was given.
+static bool takeOverStatistics(bool &asJSON) {
+  auto &options = cl::getRegisteredOptions();
+  cl::Option *stats = options.lookup("stats");
+  cl::Option *statsJSON = options.lookup("stats-json");
+  // Nothing has enabled statistics yet, so this is the value of -stats.
+  bool enabled = llvm::AreStatisticsEnabled();
+  asJSON = statsJSON && statsJSON->getNumOccurrences() > 0;
+  if (!enabled && !asJSON)
+    return false;
+  // Put the -stats flag back to its default, as if it had not been given.
+  if (enabled && stats && stats->getValueExpectedFlag() == cl::ValueOptional)
+    stats->reset();
+  llvm::EnableStatistics(false);
+  return true;
+}
+
+// Replaces the call to klee_init_env in the POSIX wrapper, which parses the
+// model options from argv at run time, with a call to klee_init_fds taking
+// the options given in Config. argv is then passed to main untouched.
+static void bakePOSIXConfig(llvm::Function *wrapper, llvm::StringRef Config) {
+  unsigned symFiles = 0, symFileLen = 0, symStdinLen = 0, maxFailures = 0;
+  int symStdout = 0, saveAllWrites = 0;
+
+  SmallVector<StringRef, 8> args;
+  SplitString(Config, args);
+  auto parseNumber = [&](size_t &i, const char *option) {
+    unsigned value;
+    if (++i == args.size() || args[i].getAsInteger(10, value))
+      linker_error("--posix-config: %s expects a number", option);
+    return value;
+  };
+  for (size_t i = 0; i < args.size(); ++i) {
+    StringRef arg = args[i];
+    // The model accepts options with one or two dashes.
+    if (arg.startswith("--"))
+      arg = arg.drop_front();
+    if (arg == "-sym-files") {
+      symFiles = parseNumber(i, "--sym-files");
+      symFileLen = parseNumber(i, "--sym-files");
+    } else if (arg == "-sym-stdin") {
+      symStdinLen = parseNumber(i, "--sym-stdin");
+    } else if (arg == "-sym-stdout") {
+      symStdout = 1;
+    } else if (arg == "-save-all-writes") {
+      saveAllWrites = 1;
+    } else if (arg == "-fd-fail") {
+      maxFailures = 1;
+    } else if (arg == "-max-fail") {
+      maxFailures = parseNumber(i, "--max-fail");
+    } else {
+      linker_error("--posix-config: '%s' cannot be applied at link time",
+                   args[i].str().c_str());
+    }
+  }
+
+  CallInst *initEnv = nullptr;
+  for (auto &BB : *wrapper)
+    for (auto &I : BB)
+      if (auto *call = dyn_cast<CallInst>(&I))
+        if (Function *callee = call->getCalledFunction())
+          if (callee->getName() == "klee_init_env")
+            initEnv = call;
+  if (!initEnv)
+    linker_error("--posix-config: klee_init_env is not called by the POSIX "
+                 "wrapper");
+
+  LLVMContext &ctx = wrapper->getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+  FunctionCallee initFds = wrapper->getParent()->getOrInsertFunction(
+      "klee_init_fds", Type::getVoidTy(ctx), i32, i32, i32, i32, i32, i32);
+  IRBuilder<> Builder(initEnv);
+  Builder.CreateCall(initFds, {ConstantInt::get(i32, symFiles),
+                               ConstantInt::get(i32, symFileLen),
+                               ConstantInt::get(i32, symStdinLen),
+                               ConstantInt::get(i32, symStdout),
+                               ConstantInt::get(i32, saveAllWrites),
+                               ConstantInt::get(i32, maxFailures)});
+  Function *initEnvFn = initEnv->getCalledFunction();
+  initEnv->eraseFromParent();
+  // Its internal helpers go with it in the next global DCE.
+  if (initEnvFn->use_empty() && !initEnvFn->isDeclaration())
+    initEnvFn->eraseFromParent();
+  linker_message("NOTE: POSIX model configured at link time: %u symbolic "
+                 "files of %u bytes, %u bytes of symbolic stdin",
+                 symFiles, symFileLen, symStdinLen);
+}
+
 static void
 preparePOSIX(std::vector<std::unique_ptr<llvm::Module>> &loadedModules,
              llvm::StringRef libCPrefix) {
@@ -250,6 +382,9 @@ preparePOSIX(std::vector<std::unique_ptr<llvm::Module>> &loadedModules,
   // Rename the POSIX wrapper to prefixed entrypoint, e.g. _user_main as uClibc
   // would expect it or main otherwise
   wrapper->setName(libCPrefix + EntryPoint);
+
+  if (!PosixConfig.empty())
+    bakePOSIXConfig(wrapper, PosixConfig);
 }
 
 // Symbols we explicitly support
@@ -469,16 +604,17 @@ linkWithUclibc(StringRef libPath, std::vector<std::unique_ptr<llvm::Module>> &mo
 int main(int argc, char **argv, char **envp) {
   atexit(llvm_shutdown);  // Call llvm_shutdown() on exit.
 
-#if LLVM_VERSION_CODE >= LLVM_VERSION(13, 0)
-  linker::HideOptions(llvm::cl::getGeneralCategory());
-#else
-  linker::HideOptions(llvm::cl::GeneralCategory);
-#endif
+  // Only show the linker's own options, not those of the LLVM libraries it
+  // links, such as Polly's options pulled in by the pass builder.
+  cl::HideUnrelatedOptions(
+      {&StartCat, &ChecksCat, &LinkCat, &linker::ModuleCat});
 
   llvm::InitializeNativeTarget();
 
   parseArguments(argc, argv);
   sys::PrintStackTraceOnErrorSignal(argv[0]);
+  bool statsAsJSON;
+  bool printStats = takeOverStatistics(statsAsJSON);
 
   // Load the bytecode...
   std::string errorMsg;
@@ -521,7 +657,9 @@ int main(int argc, char **argv, char **envp) {
   loadedModules.emplace_back(std::move(M));
 
   // Todo: get runtime library path
-  linker::ModuleOptions Opts(EntryPoint, /*Optimize=*/OptimizeModule);
+  linker::ModuleOptions Opts(EntryPoint, /*Optimize=*/OptimizeModule,
+                             /*CheckDivZero=*/CheckDivZero,
+                             /*CheckOvershift=*/CheckOvershift);
 
   bool link_with_uclibc = (UclibcPath != "");
   // if (!link_with_uclibc)
@@ -543,6 +681,22 @@ int main(int argc, char **argv, char **envp) {
   if (link_with_uclibc)
     linkWithUclibc(UclibcPath, loadedModules);
 
+  if (StringLib.getNumOccurrences()) {
+    std::string Path = StringLib;
+#ifdef LINKER_STRING_RUNTIME
+    if (Path.empty())
+      Path = LINKER_STRING_RUNTIME;
+#endif
+    if (Path.empty())
+      linker_error("--string-lib: the linker was built without the string "
+                   "library, a path is required");
+    linker_message("NOTE: Using string library: %s", Path.c_str());
+    if (!linker::loadFile(Path, mainModule->getContext(), loadedModules,
+                          errorMsg))
+      linker_error("error loading string library '%s': %s", Path.c_str(),
+                   errorMsg.c_str());
+  }
+
   for (const auto &library : LinkLibraries) {
     if (!linker::loadFile(library, mainModule->getContext(), loadedModules,
                         errorMsg))
@@ -573,5 +727,13 @@ int main(int argc, char **argv, char **envp) {
   delete outputmgr;
   delete m_linker;
 
+  if (printStats) {
+    if (statsAsJSON)
+      llvm::PrintStatisticsJSON(llvm::errs());
+    else
+      llvm::PrintStatistics(llvm::errs());
+    llvm::ResetStatistics();
+  }
+
   return 0;
 }
@@ -0,0 +1,155 @@
+//===-- strings.c ---------------------------------------------------------===//
+//
+//                     File System Linker
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// String and memory routines written for symbolic execution. The linker
+// redirects calls of the libc routine <name> to __fs_<name> (--replace-libc).
+//
+// The memory routines move and compare a word at a time, since they know how
+// many bytes they may touch. The string routines cannot read past the
+// terminator without leaving the memory object, so they work on bytes, but
+// they test each byte with a single branch instead of a chain of && and ||
+// that forks once per operand when the byte is symbolic.
+//
+// The routines are marked used so that the linker always pulls them in; the
+// ones that end up unused are removed once calls have been redirected.
+//
+//===----------------------------------------------------------------------===//
+
+#include <stddef.h>
+#include <stdint.h>
+
+unsigned klee_is_symbolic(uintptr_t n);
+
+#define FS_RUNTIME __attribute__((used))
+
+typedef uintptr_t __attribute__((may_alias)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+
+static int both_aligned(const void *a, const void *b) {
+  return (((uintptr_t)a | (uintptr_t)b) & (WORD_SIZE - 1)) == 0;
+}
+
+FS_RUNTIME void *__fs_memcpy(void *dst, const void *src, size_t n) {
+  unsigned char *d = dst;
+  const unsigned char *s = src;
+
+  if (both_aligned(d, s))
+    for (; n >= WORD_SIZE; n -= WORD_SIZE, d += WORD_SIZE, s += WORD_SIZE)
+      *(word_t *)d = *(const word_t *)s;
+  while (n--)
+    *d++ = *s++;
+  return dst;
+}
+
+FS_RUNTIME void *__fs_memmove(void *dst, const void *src, size_t n) {
+  unsigned char *d = dst;
+  const unsigned char *s = src;
+
+  if (d <= s || d >= s + n)
+    return __fs_memcpy(dst, src, n);
+
+  // Overlapping with the destination above the source: copy backwards.
+  d += n;
+  s += n;
+  if (both_aligned(d, s))
+    for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+      d -= WORD_SIZE;
+      s -= WORD_SIZE;
+      *(word_t *)d = *(const word_t *)s;
+    }
+  while (n--)
+    *--d = *--s;
+  return dst;
+}
+
+FS_RUNTIME void *__fs_memset(void *dst, int c, size_t n) {
+  unsigned char *d = dst;
+
+  if (both_aligned(d, d)) {
+    word_t w = (unsigned char)c;
+    w |= w << 8;
+    w |= w << 16;
+    if (WORD_SIZE > 4)
+      w |= w << 16 << 16;
+    for (; n >= WORD_SIZE; n -= WORD_SIZE, d += WORD_SIZE)
+      *(word_t *)d = w;
+  }
+  while (n--)
+    *d++ = (unsigned char)c;
+  return dst;
+}
+
+FS_RUNTIME int __fs_memcmp(const void *a, const void *b, size_t n) {
+  const unsigned char *l = a, *r = b;
+
+  // Skip the words that are concretely equal. Comparing symbolic words
+  // would fork on the whole word and then again on its bytes.
+  if (both_aligned(l, r))
+    for (; n >= WORD_SIZE; n -= WORD_SIZE, l += WORD_SIZE, r += WORD_SIZE) {
+      word_t wl = *(const word_t *)l, wr = *(const word_t *)r;
+      if (klee_is_symbolic(wl) || klee_is_symbolic(wr) || wl != wr)
+        break;
+    }
+  for (; n; --n, ++l, ++r)
+    if (*l != *r)
+      return *l - *r;
+  return 0;
+}
+
+FS_RUNTIME void *__fs_memchr(const void *s, int c, size_t n) {
+  const unsigned char *p = s;
+
+  for (; n; --n, ++p)
+    if (*p == (unsigned char)c)
+      return (void *)p;
+  return NULL;
+}
+
+FS_RUNTIME size_t __fs_strlen(const char *s) {
+  const char *p = s;
+
+  while (*p)
+    ++p;
+  return p - s;
+}
+
+FS_RUNTIME int __fs_strcmp(const char *a, const char *b) {
+  const unsigned char *l = (const unsigned char *)a;
+  const unsigned char *r = (const unsigned char *)b;
+
+  // One branch per byte: stop at a difference or at the end of both.
+  while (!((*l != *r) | (*l == 0))) {
+    ++l;
+    ++r;
+  }
+  return *l - *r;
+}
+
+FS_RUNTIME int __fs_strncmp(const char *a, const char *b, size_t n) {
+  const unsigned char *l = (const unsigned char *)a;
+  const unsigned char *r = (const unsigned char *)b;
+
+  if (!n)
+    return 0;
+  while (--n && !((*l != *r) | (*l == 0))) {
+    ++l;
+    ++r;
+  }
+  return *l - *r;
+}
+
+FS_RUNTIME char *__fs_strchr(const char *s, int c) {
+  const char *p = s;
+
+  // One branch per byte: stop at the character or at the terminator.
+  while (!((*p == (char)c) | (*p == 0)))
+    ++p;
+  return *p == (char)c ? (char *)p : NULL;
+}